@@ -0,0 +1,558 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <atomic>
+#include <new>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "coke/coke.h"
+#include "client/file_sender.h"
+#include "client/transfer_report.h"
+#include "server/service.h"
+#include "common/fcopy_log.h"
+#include "common/utils.h"
+
+namespace fs = std::filesystem;
+
+// Count allocations through operator new, which covers coroutine frames,
+// messages and containers of both client and servers. Buffers allocated by
+// malloc directly, such as chunks, are not counted.
+static std::atomic<uint64_t> alloc_count{0};
+
+void *operator new(std::size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+enum {
+    NODES           = 0x0101,
+    PORT            = 0x0102,
+    DIR             = 0x0103,
+    METHODS         = 0x0104,
+    CHUNK_SIZES     = 0x0105,
+    PARALLELS       = 0x0106,
+    FILES           = 0x0107,
+    ROUNDS          = 0x0108,
+    OUTPUT          = 0x0109,
+    BASELINE        = 0x010A,
+    TOLERANCE       = 0x010B,
+
+    DIRECT_IO       = 0x0200,
+    NULL_SINK       = 0x0201,
+    SYNTHETIC       = 0x0202,
+};
+
+const char *opts = "h";
+
+struct option long_opts[] = {
+    {"nodes",           1, nullptr, NODES},
+    {"port",            1, nullptr, PORT},
+    {"dir",             1, nullptr, DIR},
+    {"methods",         1, nullptr, METHODS},
+    {"chunk-sizes",     1, nullptr, CHUNK_SIZES},
+    {"parallels",       1, nullptr, PARALLELS},
+    {"files",           1, nullptr, FILES},
+    {"rounds",          1, nullptr, ROUNDS},
+    {"output",          1, nullptr, OUTPUT},
+    {"baseline",        1, nullptr, BASELINE},
+    {"tolerance",       1, nullptr, TOLERANCE},
+    {"direct-io",       0, nullptr, DIRECT_IO},
+    {"null-sink",       0, nullptr, NULL_SINK},
+    {"synthetic",       0, nullptr, SYNTHETIC},
+    {"help",            0, nullptr, 'h'},
+    {nullptr,           0, nullptr, 0},
+};
+
+struct FileMix {
+    std::string name;
+    std::vector<std::size_t> sizes;
+};
+
+struct BenchConfig {
+    int nodes = 3;
+    int port = 15000;
+    // tmpfs by default, so that the disk is not measured
+    std::string dir = "/dev/shm/fcopy-bench";
+    std::vector<std::string> methods{"chain"};
+    std::vector<std::string> chunk_sizes{"4M"};
+    std::vector<int> parallels{16};
+    std::vector<FileMix> mixes;
+    int rounds = 1;
+    bool direct_io = false;
+    // servers discard chunks, and the client sends generated data
+    bool null_sink = false;
+    bool synthetic = false;
+
+    std::string output;
+    std::string baseline;
+    // a case slower than baseline by more than tolerance is a regression
+    double tolerance = 0.05;
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t bytes = 0;
+    int64_t cost_us = 0;
+    double cpu_sec = 0;
+    uint64_t allocs = 0;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    int error = 0;
+};
+
+BenchConfig cfg;
+
+void usage(const char *name) {
+    fprintf(stdout,
+        "%s [OPTION]...\n\n"
+        "Start nodes on localhost in this process, send file mixes to them with\n"
+        "each method, chunk size and parallel, and print results in json.\n\n"
+        "  --nodes n            number of servers, default 3\n\n"
+        "  --port p             servers listen on p, p+1, ..., default 15000\n\n"
+        "  --dir path           source files and partitions of servers are created\n"
+        "                       in path, default /dev/shm/fcopy-bench\n\n"
+        "  --methods list       send methods, chain and tree, default chain\n\n"
+        "  --chunk-sizes list   chunk sizes, such as 1M,4M, default 4M\n\n"
+        "  --parallels list     parallels, such as 4,16,64, default 16\n\n"
+        "  --files mix          sizes of files in a mix, such as 1G or 4M*64,256K*512,\n"
+        "                       may be given several times, default 256M\n\n"
+        "  --rounds n           run each case n times, default 1\n\n"
+        "  --direct-io          read and write with direct io, dir must support it\n\n"
+        "  --null-sink          servers forward chunks but do not write them\n\n"
+        "  --synthetic          send generated data instead of reading source files\n\n"
+        "  --output file        write results to file instead of stdout\n\n"
+        "  --baseline file      compare throughput with results of a previous run\n\n"
+        "  --tolerance r        fail if slower than baseline by more than r,\n"
+        "                       default 0.05\n\n"
+        "  -h, --help           show this page\n"
+    , name);
+}
+
+static bool parse_mix(const std::string &arg, FileMix &mix) {
+    mix.name = arg;
+    mix.sizes.clear();
+
+    for (const std::string &item : split_string(arg, ',')) {
+        std::size_t pos = item.find('*');
+        std::size_t size;
+        int count = 1;
+
+        if (pos != std::string::npos)
+            count = std::atoi(item.c_str() + pos + 1);
+
+        if (!parse_bytes(item.substr(0, pos), size) || count <= 0)
+            return false;
+
+        mix.sizes.insert(mix.sizes.end(), count, size);
+    }
+
+    return true;
+}
+
+int parse_args(int argc, char *argv[]) {
+    std::size_t size;
+    FileMix mix;
+    const char *arg;
+    int copt;
+
+    while ((copt = getopt_long(argc, argv, opts, long_opts, nullptr)) != -1) {
+        arg = optarg ? optarg : "";
+
+        switch (copt) {
+        case NODES:     cfg.nodes = std::atoi(arg); break;
+        case PORT:      cfg.port = std::atoi(arg); break;
+        case DIR:       cfg.dir.assign(arg); break;
+        case ROUNDS:    cfg.rounds = std::atoi(arg); break;
+        case OUTPUT:    cfg.output.assign(arg); break;
+        case BASELINE:  cfg.baseline.assign(arg); break;
+        case TOLERANCE: cfg.tolerance = std::atof(arg); break;
+        case DIRECT_IO: cfg.direct_io = true; break;
+        case NULL_SINK: cfg.null_sink = true; break;
+        case SYNTHETIC: cfg.synthetic = true; break;
+
+        case METHODS:
+            cfg.methods = split_string(arg, ',');
+            for (const std::string &m : cfg.methods) {
+                if (m != "chain" && m != "tree") {
+                    FLOG_ERROR("Invalid send method %s", m.c_str());
+                    return 1;
+                }
+            }
+            break;
+
+        case CHUNK_SIZES:
+            cfg.chunk_sizes = split_string(arg, ',');
+            for (const std::string &c : cfg.chunk_sizes) {
+                if (!parse_bytes(c, size) || size % FCOPY_CHUNK_BASE != 0) {
+                    FLOG_ERROR("Invalid chunk size %s", c.c_str());
+                    return 1;
+                }
+            }
+            break;
+
+        case PARALLELS:
+            cfg.parallels.clear();
+            for (const std::string &p : split_string(arg, ',')) {
+                cfg.parallels.push_back(std::atoi(p.c_str()));
+                if (cfg.parallels.back() < 1 || cfg.parallels.back() > 900) {
+                    FLOG_ERROR("Invalid parallel %s", p.c_str());
+                    return 1;
+                }
+            }
+            break;
+
+        case FILES:
+            if (!parse_mix(arg, mix)) {
+                FLOG_ERROR("Invalid file mix %s", arg);
+                return 1;
+            }
+            cfg.mixes.push_back(mix);
+            break;
+
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(0);
+        }
+    }
+
+    if (cfg.mixes.empty()) {
+        parse_mix("256M", mix);
+        cfg.mixes.push_back(mix);
+    }
+
+    if (cfg.nodes < 1 || cfg.port < 1 || cfg.port + cfg.nodes > 65536 || cfg.rounds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
+
+// fill the file with pseudo random bytes, so that it is not sparse
+static int create_source(const std::string &path, std::size_t size) {
+    std::vector<uint64_t> buf(128 * 1024);
+    uint64_t x = size | 1;
+    std::size_t off = 0;
+    int fd, ret = 0;
+
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return errno;
+
+    while (off < size && ret == 0) {
+        std::size_t n = std::min(size - off, buf.size() * sizeof(uint64_t));
+
+        for (uint64_t &v : buf) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            v = x;
+        }
+
+        if (pwrite(fd, buf.data(), n, (off_t)off) != (ssize_t)n)
+            ret = errno ? errno : EIO;
+
+        off += n;
+    }
+
+    close(fd);
+    return ret;
+}
+
+static double cpu_seconds() {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1.0e6;
+}
+
+// remove files received in the previous case
+static void reset_nodes() {
+    std::error_code ec;
+
+    for (int i = 0; i < cfg.nodes; i++) {
+        std::string dir = cfg.dir + "/node-" + std::to_string(i);
+
+        fs::remove_all(dir, ec);
+        fs::create_directories(dir, ec);
+    }
+}
+
+coke::Task<int> send_mix(FcopyClient &cli, FcopyClient &ctrl_cli, SenderParams params,
+                         const FileMix &mix, const std::vector<std::string> &sources,
+                         TransferProgress &progress) {
+    int error = 0;
+
+    for (std::size_t i = 0; i < sources.size() && error == 0; i++) {
+        params.file_path = sources[i];
+        params.remote_file_name = "file-" + std::to_string(i);
+        params.synthetic_size = cfg.synthetic ? mix.sizes[i] : 0;
+
+        FileSender h(cli, params);
+        h.set_control_client(&ctrl_cli);
+        h.set_progress(&progress);
+
+        error = co_await h.create_file();
+        if (error == 0)
+            error = co_await h.send_file();
+
+        int close_error = co_await h.close_file();
+        if (error == 0)
+            error = close_error;
+    }
+
+    co_return error;
+}
+
+BenchResult run_case(FcopyClient &cli, FcopyClient &ctrl_cli, const std::string &method,
+                     const std::string &chunk_size, int parallel, const FileMix &mix,
+                     const std::vector<std::string> &sources) {
+    TransferProgress progress;
+    std::vector<uint64_t> counts(Histogram::BUCKETS);
+    uint64_t sum;
+    std::size_t size = 0;
+    BenchResult r;
+
+    SenderParams params;
+    params.partition = "";
+    params.remote_file_dir = ".";
+    params.parallel = parallel;
+    params.send_method = (method == "tree") ? SEND_METHOD_TREE : SEND_METHOD_CHAIN;
+    params.direct_io = cfg.direct_io;
+    params.wait_close = true;
+
+    parse_bytes(chunk_size, size);
+    params.chunk_size = (uint32_t)size;
+
+    for (int i = 0; i < cfg.nodes; i++) {
+        params.targets.emplace_back("127.0.0.1", (unsigned short)(cfg.port + i));
+        resolve_target(params.targets.back());
+    }
+
+    r.name = method + "/n" + std::to_string(cfg.nodes) + "/c" + chunk_size +
+             "/p" + std::to_string(parallel) + "/" + mix.name;
+    if (cfg.synthetic)
+        r.name.append("/synthetic");
+    if (cfg.null_sink)
+        r.name.append("/null-sink");
+
+    reset_nodes();
+
+    double cpu = cpu_seconds();
+    uint64_t allocs = alloc_count.load(std::memory_order_relaxed);
+    int64_t start = current_usec();
+
+    r.error = coke::sync_wait(send_mix(cli, ctrl_cli, params, mix, sources, progress));
+
+    r.cost_us = current_usec() - start;
+    r.allocs = alloc_count.load(std::memory_order_relaxed) - allocs;
+    r.cpu_sec = cpu_seconds() - cpu;
+    r.bytes = progress.acked_bytes;
+
+    progress.chunk_latency.snapshot(counts.data(), sum);
+    r.p50 = Histogram::quantile(counts.data(), 0.5);
+    r.p99 = Histogram::quantile(counts.data(), 0.99);
+
+    return r;
+}
+
+static std::string format_result(const BenchResult &r) {
+    double gb = r.bytes / (double)(1ULL << 30);
+    char buf[512];
+
+    snprintf(buf, sizeof(buf),
+        "{\"name\": %s, \"error\": %d, \"bytes\": %llu, \"cost_us\": %lld, "
+        "\"bytes_per_second\": %.0lf, \"chunk_p50_us\": %llu, \"chunk_p99_us\": %llu, "
+        "\"cpu_sec_per_gb\": %.4lf, \"allocs_per_gb\": %.0lf}",
+        json_quote(r.name).c_str(), r.error, (unsigned long long)r.bytes,
+        (long long)r.cost_us, r.cost_us > 0 ? r.bytes * 1.0e6 / r.cost_us : 0.0,
+        (unsigned long long)r.p50, (unsigned long long)r.p99,
+        gb > 0 ? r.cpu_sec / gb : 0.0, gb > 0 ? r.allocs / gb : 0.0);
+
+    return buf;
+}
+
+// results are written one case per line, so that a baseline is read back
+// without a json parser
+static bool load_baseline(const std::string &path, std::map<std::string, double> &speeds) {
+    std::ifstream ifs(path);
+    std::string line;
+
+    if (!ifs)
+        return false;
+
+    while (std::getline(ifs, line)) {
+        std::size_t name_pos = line.find("{\"name\": \"");
+        std::size_t speed_pos = line.find("\"bytes_per_second\": ");
+
+        if (name_pos == std::string::npos || speed_pos == std::string::npos)
+            continue;
+
+        name_pos += 10;
+        std::size_t name_end = line.find('"', name_pos);
+        if (name_end == std::string::npos)
+            continue;
+
+        speeds[line.substr(name_pos, name_end - name_pos)] = std::atof(line.c_str() + speed_pos + 20);
+    }
+
+    return true;
+}
+
+// return the number of regressions
+static int compare_baseline(const std::vector<BenchResult> &results) {
+    std::map<std::string, double> speeds;
+    int regressions = 0;
+
+    if (!load_baseline(cfg.baseline, speeds)) {
+        FLOG_ERROR("LoadBaselineFailed file:%s", cfg.baseline.c_str());
+        return 1;
+    }
+
+    for (const BenchResult &r : results) {
+        auto it = speeds.find(r.name);
+        if (it == speeds.end() || it->second <= 0)
+            continue;
+
+        double speed = r.cost_us > 0 ? r.bytes * 1.0e6 / r.cost_us : 0.0;
+        double ratio = speed / it->second;
+        bool regressed = ratio < 1.0 - cfg.tolerance;
+
+        if (regressed)
+            regressions++;
+
+        FLOG_INFO("Compare case:%s ratio:%.3lf%s", r.name.c_str(), ratio,
+                  regressed ? " REGRESSION" : "");
+    }
+
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    fcopy_set_log_stream(stderr);
+
+    int ret = parse_args(argc, argv);
+    if (ret != 0)
+        return ret;
+
+    coke::GlobalSettings settings;
+    settings.endpoint_params.max_connections = 4096;
+    coke::library_init(settings);
+
+    std::error_code ec;
+    fs::create_directories(cfg.dir + "/src", ec);
+    if (ec) {
+        FLOG_ERROR("CreateDirFailed dir:%s error:%d", cfg.dir.c_str(), ec.value());
+        return 1;
+    }
+
+    std::vector<std::vector<std::string>> mix_sources;
+    for (std::size_t m = 0; m < cfg.mixes.size(); m++) {
+        std::vector<std::string> sources;
+
+        for (std::size_t i = 0; i < cfg.mixes[m].sizes.size(); i++) {
+            std::string path = cfg.dir + "/src/mix-" + std::to_string(m) + "-" + std::to_string(i);
+
+            if (!cfg.synthetic)
+                ret = create_source(path, cfg.mixes[m].sizes[i]);
+
+            if (ret != 0) {
+                FLOG_ERROR("CreateSourceFailed file:%s error:%d", path.c_str(), ret);
+                return 1;
+            }
+
+            sources.push_back(path);
+        }
+
+        mix_sources.push_back(std::move(sources));
+    }
+
+    std::vector<std::unique_ptr<FcopyService>> services;
+    for (int i = 0; i < cfg.nodes; i++) {
+        FcopyServiceParams params;
+        params.directio = cfg.direct_io;
+        params.port = cfg.port + i;
+        params.default_partition = cfg.dir + "/node-" + std::to_string(i);
+        params.default_policy.null_sink = cfg.null_sink;
+
+        services.push_back(std::make_unique<FcopyService>(params));
+        if (services.back()->start() != 0) {
+            FLOG_ERROR("StartNodeFailed port:%d", params.port);
+            services.pop_back();
+            ret = 1;
+            break;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    FcopyClient cli(FcopyClientParams{});
+    FcopyClientParams ctrl_params;
+    ctrl_params.lane = "control";
+    FcopyClient ctrl_cli(ctrl_params);
+
+    for (const std::string &method : cfg.methods) {
+        for (const std::string &chunk_size : cfg.chunk_sizes) {
+            for (int parallel : cfg.parallels) {
+                for (std::size_t m = 0; m < cfg.mixes.size() && ret == 0; m++) {
+                    for (int round = 0; round < cfg.rounds; round++) {
+                        results.push_back(run_case(cli, ctrl_cli, method, chunk_size,
+                                                   parallel, cfg.mixes[m], mix_sources[m]));
+
+                        const BenchResult &r = results.back();
+                        FLOG_INFO("CaseDone %s", format_result(r).c_str());
+                        if (r.error)
+                            ret = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    for (auto &service : services)
+        service->stop();
+
+    FILE *fp = cfg.output.empty() ? stdout : fopen(cfg.output.c_str(), "w");
+    if (!fp) {
+        FLOG_ERROR("OpenOutputFailed file:%s error:%d", cfg.output.c_str(), errno);
+        return 1;
+    }
+
+    fprintf(fp, "{\"nodes\": %d, \"cases\": [\n", cfg.nodes);
+    for (std::size_t i = 0; i < results.size(); i++)
+        fprintf(fp, "%s%s", format_result(results[i]).c_str(),
+                i + 1 < results.size() ? ",\n" : "\n");
+    fprintf(fp, "]}\n");
+
+    if (fp != stdout)
+        fclose(fp);
+
+    if (ret == 0 && !cfg.baseline.empty() && compare_baseline(results) > 0)
+        ret = 2;
+
+    // only remove what the bench created, dir may be given by the user
+    fs::remove_all(cfg.dir + "/src", ec);
+    for (int i = 0; i < cfg.nodes; i++)
+        fs::remove_all(cfg.dir + "/node-" + std::to_string(i), ec);
+
+    return ret;
+}
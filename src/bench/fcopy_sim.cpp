@@ -0,0 +1,532 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+
+#include "client/file_sender.h"
+#include "common/rate_limiter.h"
+#include "common/metrics.h"
+#include "common/fcopy_log.h"
+#include "common/utils.h"
+
+// fcopy-sim predicts the completion time of sending files to a large fleet,
+// with modeled links and disks instead of real ones. The layout of targets is
+// send_layout of FileSender, chunks are claimed by parallel workers like
+// FileSender::parallel_send, and limits are RateLimiter on a virtual clock.
+//
+// Each node has a full duplex link and a disk. A chunk occupies the egress of
+// the sender and the ingress of the receiver for size / min(rate) after both
+// are free, so chunks on a link are serialized in the order they are sent. A
+// server writes a chunk and forwards it to its next targets at once, and acks
+// after the write and the acks of all next targets, as the service does.
+
+enum {
+    NODES           = 0x0101,
+    METHODS         = 0x0102,
+    CHUNK_SIZES     = 0x0103,
+    PARALLELS       = 0x0104,
+    FILE_SIZE       = 0x0105,
+    FILES           = 0x0106,
+    RUNS            = 0x0107,
+    SEED            = 0x0108,
+    LINK_RATE       = 0x0109,
+    LINK_JITTER     = 0x010A,
+    DISK_RATE       = 0x010B,
+    DISK_JITTER     = 0x010C,
+    SLOW_FRACTION   = 0x010D,
+    SLOW_FACTOR     = 0x010E,
+    RTT             = 0x010F,
+    NODE_MTBF       = 0x0110,
+    SPEED_LIMIT     = 0x0111,
+    FORWARD_LIMIT   = 0x0112,
+    OUTPUT          = 0x0113,
+};
+
+const char *opts = "h";
+
+struct option long_opts[] = {
+    {"nodes",           1, nullptr, NODES},
+    {"methods",         1, nullptr, METHODS},
+    {"chunk-sizes",     1, nullptr, CHUNK_SIZES},
+    {"parallels",       1, nullptr, PARALLELS},
+    {"file-size",       1, nullptr, FILE_SIZE},
+    {"files",           1, nullptr, FILES},
+    {"runs",            1, nullptr, RUNS},
+    {"seed",            1, nullptr, SEED},
+    {"link-rate",       1, nullptr, LINK_RATE},
+    {"link-jitter",     1, nullptr, LINK_JITTER},
+    {"disk-rate",       1, nullptr, DISK_RATE},
+    {"disk-jitter",     1, nullptr, DISK_JITTER},
+    {"slow-fraction",   1, nullptr, SLOW_FRACTION},
+    {"slow-factor",     1, nullptr, SLOW_FACTOR},
+    {"rtt",             1, nullptr, RTT},
+    {"node-mtbf",       1, nullptr, NODE_MTBF},
+    {"speed-limit",     1, nullptr, SPEED_LIMIT},
+    {"forward-limit",   1, nullptr, FORWARD_LIMIT},
+    {"output",          1, nullptr, OUTPUT},
+    {"help",            0, nullptr, 'h'},
+    {nullptr,           0, nullptr, 0},
+};
+
+struct SimConfig {
+    int nodes = 100;
+    std::vector<std::string> methods{"chain"};
+    std::vector<std::string> chunk_sizes{"4M"};
+    std::vector<int> parallels{16};
+    std::size_t file_size = 1ULL << 30;
+    int files = 1;
+    int runs = 20;
+    uint64_t seed = 1;
+
+    // in MB per second, each node draws rate * (1 +- jitter), and a fraction
+    // of slow nodes run at rate * slow_factor
+    double link_rate = 1250;
+    double link_jitter = 0.1;
+    double disk_rate = 2000;
+    double disk_jitter = 0.1;
+    double slow_fraction = 0;
+    double slow_factor = 0.1;
+
+    // round trip time between any two hosts, in microseconds
+    double rtt = 200;
+    // mean hours between failures of a node, 0 means no failure
+    double node_mtbf = 0;
+
+    // in MB per second, limit of the client and of forwarding on each server
+    double speed_limit = 0;
+    double forward_limit = 0;
+
+    std::string output;
+};
+
+struct SimCase {
+    std::string name;
+    int send_method;
+    std::size_t chunk_size;
+    int parallel;
+};
+
+struct CaseResult {
+    std::string name;
+    std::vector<double> cost_us;
+    int failed = 0;
+    Histogram chunk_latency;
+};
+
+SimConfig cfg;
+
+void usage(const char *name) {
+    fprintf(stdout,
+        "%s [OPTION]...\n\n"
+        "Simulate sending files to a fleet with each method, chunk size and\n"
+        "parallel, and print the distribution of completion time in json.\n\n"
+        "  --nodes n            number of targets, default 100\n\n"
+        "  --methods list       send methods, chain and tree, default chain\n\n"
+        "  --chunk-sizes list   chunk sizes, such as 1M,4M, default 4M\n\n"
+        "  --parallels list     parallels, such as 4,16,64, default 16\n\n"
+        "  --file-size size     size of each file, default 1G\n\n"
+        "  --files n            number of files sent one by one, default 1\n\n"
+        "  --runs n             fleets drawn for each case, default 20\n\n"
+        "  --seed n             seed of the first fleet, default 1\n\n"
+        "  --link-rate n        link rate of nodes in MB, default 1250\n\n"
+        "  --link-jitter r      link rates vary by up to r, default 0.1\n\n"
+        "  --disk-rate n        disk rate of nodes in MB, default 2000\n\n"
+        "  --disk-jitter r      disk rates vary by up to r, default 0.1\n\n"
+        "  --slow-fraction f    fraction of slow nodes, default 0\n\n"
+        "  --slow-factor x      slow nodes run at x of the rates, default 0.1\n\n"
+        "  --rtt us             round trip time between hosts, default 200\n\n"
+        "  --node-mtbf hours    mean time between failures of a node, default\n"
+        "                       no failure\n\n"
+        "  --speed-limit n      rate limit of the client in MB\n\n"
+        "  --forward-limit n    forward rate limit of each server in MB\n\n"
+        "  --output file        write results to file instead of stdout\n\n"
+        "  -h, --help           show this page\n"
+    , name);
+}
+
+int parse_args(int argc, char *argv[]) {
+    std::size_t size;
+    const char *arg;
+    int copt;
+
+    while ((copt = getopt_long(argc, argv, opts, long_opts, nullptr)) != -1) {
+        arg = optarg ? optarg : "";
+
+        switch (copt) {
+        case NODES:         cfg.nodes = std::atoi(arg); break;
+        case FILES:         cfg.files = std::atoi(arg); break;
+        case RUNS:          cfg.runs = std::atoi(arg); break;
+        case SEED:          cfg.seed = std::strtoull(arg, nullptr, 10); break;
+        case LINK_RATE:     cfg.link_rate = std::atof(arg); break;
+        case LINK_JITTER:   cfg.link_jitter = std::atof(arg); break;
+        case DISK_RATE:     cfg.disk_rate = std::atof(arg); break;
+        case DISK_JITTER:   cfg.disk_jitter = std::atof(arg); break;
+        case SLOW_FRACTION: cfg.slow_fraction = std::atof(arg); break;
+        case SLOW_FACTOR:   cfg.slow_factor = std::atof(arg); break;
+        case RTT:           cfg.rtt = std::atof(arg); break;
+        case NODE_MTBF:     cfg.node_mtbf = std::atof(arg); break;
+        case SPEED_LIMIT:   cfg.speed_limit = std::atof(arg); break;
+        case FORWARD_LIMIT: cfg.forward_limit = std::atof(arg); break;
+        case OUTPUT:        cfg.output.assign(arg); break;
+
+        case METHODS:
+            cfg.methods = split_string(arg, ',');
+            for (const std::string &m : cfg.methods) {
+                if (m != "chain" && m != "tree") {
+                    FLOG_ERROR("Invalid send method %s", m.c_str());
+                    return 1;
+                }
+            }
+            break;
+
+        case CHUNK_SIZES:
+            cfg.chunk_sizes = split_string(arg, ',');
+            for (const std::string &c : cfg.chunk_sizes) {
+                if (!parse_bytes(c, size) || size % FCOPY_CHUNK_BASE != 0) {
+                    FLOG_ERROR("Invalid chunk size %s", c.c_str());
+                    return 1;
+                }
+            }
+            break;
+
+        case PARALLELS:
+            cfg.parallels.clear();
+            for (const std::string &p : split_string(arg, ',')) {
+                cfg.parallels.push_back(std::atoi(p.c_str()));
+                if (cfg.parallels.back() < 1 || cfg.parallels.back() > 900) {
+                    FLOG_ERROR("Invalid parallel %s", p.c_str());
+                    return 1;
+                }
+            }
+            break;
+
+        case FILE_SIZE:
+            if (!parse_bytes(arg, cfg.file_size)) {
+                FLOG_ERROR("Invalid file size %s", arg);
+                return 1;
+            }
+            break;
+
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(0);
+        }
+    }
+
+    if (cfg.nodes < 1 || cfg.files < 1 || cfg.runs < 1 || cfg.link_rate <= 0 ||
+        cfg.disk_rate <= 0 || cfg.slow_factor <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
+
+class FleetSim {
+    struct Node {
+        // bytes per microsecond
+        double link_rate;
+        double disk_rate;
+        double fail_at;
+
+        double egress_free;
+        double ingress_free;
+        double disk_free;
+        std::unique_ptr<RateLimiter> forward;
+    };
+
+    enum {
+        EV_CLAIM,       // a worker claims the next chunk
+        EV_SEND,        // `from` starts sending `chunk` to `to`
+        EV_ARRIVE,      // `chunk` is received by `to`
+        EV_DONE,        // `to` finished one part of `chunk`, a write or an ack
+    };
+
+    struct Event {
+        double t;
+        int type;
+        int from;
+        int to;
+        uint64_t chunk;
+
+        bool operator>(const Event &o) const { return t > o.t; }
+    };
+
+public:
+    FleetSim(uint64_t seed);
+
+    // return microseconds to send all files, or -1 if a node failed
+    double run(const SimCase &c, Histogram &chunk_latency);
+
+private:
+    double send_file(const SimCase &c, double start, Histogram &chunk_latency);
+    void push(double t, int type, int from, int to, uint64_t chunk) {
+        events.push(Event{t, type, from, to, chunk});
+    }
+
+    double fail() {
+        events = decltype(events)();
+        return -1;
+    }
+
+    // RateLimiter runs on the steady clock, shift the virtual time onto it
+    int64_t clock(double t) const { return base_usec + (int64_t)t; }
+
+private:
+    // targets are 0 to n-1, and the client is n
+    std::vector<Node> nodes;
+    int n;
+    int64_t base_usec;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+};
+
+FleetSim::FleetSim(uint64_t seed) : n(cfg.nodes), base_usec(0) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    constexpr double MB = 1024 * 1024 / 1.0e6;
+
+    auto draw = [&](double rate, double jitter, bool slow) {
+        double r = rate * MB * (1.0 + jitter * (unit(rng) * 2 - 1));
+        return std::max(r * (slow ? cfg.slow_factor : 1.0), 1.0e-3);
+    };
+
+    nodes.resize(n + 1);
+    for (int i = 0; i <= n; i++) {
+        Node &node = nodes[i];
+        bool slow = (i < n) && unit(rng) < cfg.slow_fraction;
+
+        node.link_rate = draw(cfg.link_rate, (i < n) ? cfg.link_jitter : 0, slow);
+        node.disk_rate = draw(cfg.disk_rate, cfg.disk_jitter, slow);
+        node.fail_at = std::numeric_limits<double>::infinity();
+
+        if (i < n && cfg.node_mtbf > 0) {
+            std::exponential_distribution<double> fail(1.0 / (cfg.node_mtbf * 3600 * 1.0e6));
+            node.fail_at = fail(rng);
+        }
+    }
+}
+
+double FleetSim::run(const SimCase &c, Histogram &chunk_latency) {
+    auto layout = send_layout(c.send_method, n);
+    double t = 0;
+
+    // rate limiters keep tokens across files, but not across cases
+    nodes[n].forward = std::make_unique<RateLimiter>((std::size_t)(cfg.speed_limit * 1024 * 1024));
+    for (int i = 0; i < n; i++) {
+        nodes[i].forward = std::make_unique<RateLimiter>((std::size_t)(cfg.forward_limit * 1024 * 1024));
+        nodes[i].egress_free = nodes[i].ingress_free = nodes[i].disk_free = 0;
+    }
+    nodes[n].egress_free = nodes[n].ingress_free = 0;
+    base_usec = current_usec();
+
+    // create, set layout and close requests are sent one by one
+    std::size_t nset = std::count_if(layout.begin(), layout.end(),
+                                     [](const auto &v) { return !v.empty(); });
+    double control_us = (2.0 * n + nset) * cfg.rtt;
+
+    for (int f = 0; f < cfg.files; f++) {
+        t = send_file(c, t + control_us, chunk_latency);
+        if (t < 0)
+            return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (nodes[i].fail_at <= t)
+            return -1;
+    }
+
+    return t;
+}
+
+double FleetSim::send_file(const SimCase &c, double start, Histogram &chunk_latency) {
+    auto layout = send_layout(c.send_method, n);
+    std::vector<int> parent(n, n);
+    uint64_t nchunks = (cfg.file_size + c.chunk_size - 1) / c.chunk_size;
+    uint64_t next_chunk = 0;
+    double half_rtt = cfg.rtt / 2;
+    double end = start;
+
+    std::vector<double> chunk_start(nchunks);
+    std::unordered_map<uint64_t, int> pending;
+
+    for (int i = 0; i < n; i++) {
+        for (std::size_t j : layout[i])
+            parent[j] = i;
+    }
+
+    auto chunk_bytes = [&](uint64_t chunk) {
+        return std::min<uint64_t>(c.chunk_size, cfg.file_size - chunk * c.chunk_size);
+    };
+
+    for (int w = 0; w < c.parallel; w++)
+        push(start, EV_CLAIM, n, n, 0);
+
+    while (!events.empty()) {
+        Event ev = events.top();
+        events.pop();
+
+        if (ev.type == EV_CLAIM) {
+            if (next_chunk >= nchunks)
+                continue;
+
+            uint64_t chunk = next_chunk++;
+            int64_t delay = nodes[n].forward->reserve(chunk_bytes(chunk), clock(ev.t));
+
+            chunk_start[chunk] = ev.t;
+            push(ev.t + delay, EV_SEND, n, 0, chunk);
+        }
+        else if (ev.type == EV_SEND) {
+            Node &from = nodes[ev.from];
+            Node &to = nodes[ev.to];
+            double rate = std::min(from.link_rate, to.link_rate);
+            double t = std::max({ev.t, from.egress_free, to.ingress_free});
+
+            t += chunk_bytes(ev.chunk) / rate;
+            from.egress_free = to.ingress_free = t;
+            push(t + half_rtt, EV_ARRIVE, ev.from, ev.to, ev.chunk);
+        }
+        else if (ev.type == EV_ARRIVE) {
+            Node &node = nodes[ev.to];
+            std::size_t size = chunk_bytes(ev.chunk);
+
+            if (node.fail_at <= ev.t)
+                return fail();
+
+            pending[ev.chunk * n + ev.to] = 1 + (int)layout[ev.to].size();
+
+            node.disk_free = std::max(ev.t, node.disk_free) + size / node.disk_rate;
+            push(node.disk_free, EV_DONE, ev.to, ev.to, ev.chunk);
+
+            for (std::size_t j : layout[ev.to]) {
+                int64_t delay = node.forward->reserve(size, clock(ev.t));
+                push(ev.t + delay, EV_SEND, ev.to, (int)j, ev.chunk);
+            }
+        }
+        else if (ev.to == n) {
+            // acked by the first target, the worker claims the next chunk
+            chunk_latency.record((int64_t)(ev.t - chunk_start[ev.chunk]));
+            end = std::max(end, ev.t);
+            push(ev.t, EV_CLAIM, n, n, 0);
+        }
+        else {
+            if (nodes[ev.to].fail_at <= ev.t)
+                return fail();
+
+            auto it = pending.find(ev.chunk * n + ev.to);
+            if (--it->second > 0)
+                continue;
+
+            pending.erase(it);
+            push(ev.t + half_rtt, EV_DONE, ev.to, parent[ev.to], ev.chunk);
+        }
+    }
+
+    return end;
+}
+
+static std::string format_result(const CaseResult &r) {
+    std::vector<double> v = r.cost_us;
+    std::vector<uint64_t> counts(Histogram::BUCKETS);
+    double bytes = (double)cfg.file_size * cfg.files;
+    double sum = 0;
+    uint64_t latency_sum;
+    char buf[512];
+
+    std::sort(v.begin(), v.end());
+    for (double x : v)
+        sum += x;
+
+    auto pick = [&v](double q) {
+        if (v.empty())
+            return 0.0;
+        return v[std::min(v.size() - 1, (std::size_t)(q * v.size()))];
+    };
+
+    r.chunk_latency.snapshot(counts.data(), latency_sum);
+
+    snprintf(buf, sizeof(buf),
+        "{\"name\": %s, \"runs\": %d, \"failed\": %d, \"p50_us\": %.0lf, "
+        "\"p90_us\": %.0lf, \"p99_us\": %.0lf, \"max_us\": %.0lf, "
+        "\"mean_bytes_per_second\": %.0lf, \"chunk_p50_us\": %llu, \"chunk_p99_us\": %llu}",
+        json_quote(r.name).c_str(), cfg.runs, r.failed, pick(0.5), pick(0.9),
+        pick(0.99), v.empty() ? 0.0 : v.back(),
+        sum > 0 ? bytes * v.size() * 1.0e6 / sum : 0.0,
+        (unsigned long long)Histogram::quantile(counts.data(), 0.5),
+        (unsigned long long)Histogram::quantile(counts.data(), 0.99));
+
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    fcopy_set_log_stream(stderr);
+
+    int ret = parse_args(argc, argv);
+    if (ret != 0)
+        return ret;
+
+    std::vector<SimCase> cases;
+    for (const std::string &method : cfg.methods) {
+        for (const std::string &chunk_size : cfg.chunk_sizes) {
+            for (int parallel : cfg.parallels) {
+                SimCase c;
+                std::size_t size = 0;
+
+                parse_bytes(chunk_size, size);
+                c.name = method + "/n" + std::to_string(cfg.nodes) + "/c" + chunk_size +
+                         "/p" + std::to_string(parallel);
+                c.send_method = (method == "tree") ? SEND_METHOD_TREE : SEND_METHOD_CHAIN;
+                c.chunk_size = size;
+                c.parallel = parallel;
+                cases.push_back(c);
+            }
+        }
+    }
+
+    FILE *fp = cfg.output.empty() ? stdout : fopen(cfg.output.c_str(), "w");
+    if (!fp) {
+        FLOG_ERROR("OpenOutputFailed file:%s error:%d", cfg.output.c_str(), errno);
+        return 1;
+    }
+
+    fprintf(fp, "{\"nodes\": %d, \"file_size\": %zu, \"files\": %d, \"cases\": [\n",
+            cfg.nodes, cfg.file_size, cfg.files);
+
+    for (std::size_t i = 0; i < cases.size(); i++) {
+        CaseResult r;
+        r.name = cases[i].name;
+
+        // the same fleets for every case, so that cases are comparable
+        for (int run = 0; run < cfg.runs; run++) {
+            FleetSim sim(cfg.seed + run);
+            double cost = sim.run(cases[i], r.chunk_latency);
+
+            if (cost < 0)
+                r.failed++;
+            else
+                r.cost_us.push_back(cost);
+        }
+
+        std::string line = format_result(r);
+        FLOG_INFO("CaseDone %s", line.c_str());
+        fprintf(fp, "%s%s", line.c_str(), i + 1 < cases.size() ? ",\n" : "\n");
+    }
+
+    fprintf(fp, "]}\n");
+
+    if (fp != stdout)
+        fclose(fp);
+
+    return 0;
+}
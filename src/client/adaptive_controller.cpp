@@ -0,0 +1,119 @@
+#include "client/adaptive_controller.h"
+
+#include <algorithm>
+
+#include "common/message.h"
+#include "common/utils.h"
+#include "common/fcopy_log.h"
+
+// a round lasts at least this long, to smooth out single slow chunks
+constexpr int64_t MIN_ROUND_US = 100 * 1000;
+
+AdaptiveController::AdaptiveController(const AdaptiveParams &params)
+    : params(params)
+{
+    this->params.min_parallel = std::max(params.min_parallel, 1);
+    this->params.max_parallel = std::max(params.max_parallel, this->params.min_parallel);
+
+    parallel = std::clamp(params.init_parallel, this->params.min_parallel,
+                          this->params.max_parallel);
+    chunk_size = align_chunk(params.init_chunk);
+
+    round_start = current_usec();
+    round_bytes = 0;
+    round_chunks = 0;
+    round_latency = 0;
+
+    last_goodput = 0;
+    min_us_per_mb = 0;
+}
+
+int AdaptiveController::get_parallel() {
+    std::lock_guard<std::mutex> lg(mtx);
+    return static_cast<int>(parallel);
+}
+
+std::size_t AdaptiveController::get_chunk_size() {
+    std::lock_guard<std::mutex> lg(mtx);
+    return chunk_size;
+}
+
+void AdaptiveController::set_max_chunk_size(std::size_t size) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    size = size / FCOPY_CHUNK_BASE * FCOPY_CHUNK_BASE;
+    if (size == 0)
+        return;
+
+    // every target of the chain must accept the chunk, and servers never
+    // raise the local limit
+    params.max_chunk = std::min(params.max_chunk, size);
+    params.min_chunk = std::min(params.min_chunk, params.max_chunk);
+    chunk_size = align_chunk(chunk_size);
+}
+
+std::size_t AdaptiveController::get_max_chunk_size() {
+    std::lock_guard<std::mutex> lg(mtx);
+    return params.max_chunk;
+}
+
+void AdaptiveController::on_chunk_done(std::size_t bytes, int64_t latency_us) {
+    std::lock_guard<std::mutex> lg(mtx);
+    int64_t now = current_usec();
+
+    round_bytes += bytes;
+    round_chunks += 1;
+    round_latency += latency_us;
+
+    if (round_chunks >= static_cast<int>(parallel) && now - round_start >= MIN_ROUND_US)
+        end_round(now);
+}
+
+void AdaptiveController::on_server_busy() {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    parallel = std::max(parallel / 2, (double)params.min_parallel);
+}
+
+void AdaptiveController::end_round(int64_t now) {
+    double goodput = round_bytes * 1.0e6 / (now - round_start);
+    double mb = round_bytes / 1048576.0;
+    double us_per_mb = mb > 0 ? round_latency / mb : 0;
+    int64_t avg_latency = round_latency / round_chunks;
+
+    if (min_us_per_mb == 0 || us_per_mb < min_us_per_mb)
+        min_us_per_mb = us_per_mb;
+
+    if (last_goodput == 0 || goodput > last_goodput * 1.05) {
+        // additive increase while it helps
+        parallel += 1;
+    }
+    else if (goodput < last_goodput * 0.9 || us_per_mb > min_us_per_mb * 2) {
+        // goodput dropped or chunks are queueing somewhere
+        parallel *= 0.75;
+    }
+
+    parallel = std::clamp(parallel, (double)params.min_parallel, (double)params.max_parallel);
+
+    // large chunks amortize per request cost, small chunks keep latency low
+    if (avg_latency < params.fast_chunk_us)
+        chunk_size = align_chunk(chunk_size * 2);
+    else if (avg_latency > params.slow_chunk_us)
+        chunk_size = align_chunk(chunk_size / 2);
+
+    FLOG_DEBUG("AdaptiveRound goodput:%.0lf latency:%ld parallel:%d chunk_size:%zu",
+        goodput, (long)avg_latency, static_cast<int>(parallel), chunk_size);
+
+    last_goodput = goodput;
+    round_start = now;
+    round_bytes = 0;
+    round_chunks = 0;
+    round_latency = 0;
+}
+
+std::size_t AdaptiveController::align_chunk(std::size_t size) const {
+    size = std::clamp(size, params.min_chunk, params.max_chunk);
+    size = size / FCOPY_CHUNK_BASE * FCOPY_CHUNK_BASE;
+
+    return std::max(size, FCOPY_CHUNK_BASE);
+}
@@ -0,0 +1,61 @@
+#ifndef FCOPY_ADAPTIVE_CONTROLLER_H
+#define FCOPY_ADAPTIVE_CONTROLLER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+struct AdaptiveParams {
+    int min_parallel        = 1;
+    int max_parallel        = 64;
+    int init_parallel       = 4;
+
+    std::size_t min_chunk   = 1UL * 1024 * 1024;
+    std::size_t max_chunk   = 64UL * 1024 * 1024;
+    std::size_t init_chunk  = 4UL * 1024 * 1024;
+
+    // grow chunk if chunks finish faster than this, shrink if slower
+    int64_t fast_chunk_us   = 50 * 1000;
+    int64_t slow_chunk_us   = 500 * 1000;
+};
+
+// AdaptiveController tunes the number of chunks in flight and the chunk size
+// from the goodput and latency of finished chunks. Parallelism grows by one
+// while goodput grows, and backs off multiplicatively when goodput drops,
+// latency builds up or a server is busy.
+class AdaptiveController {
+public:
+    AdaptiveController(const AdaptiveParams &params = AdaptiveParams());
+    AdaptiveController(const AdaptiveController &) = delete;
+
+    int get_parallel();
+    std::size_t get_chunk_size();
+
+    // limit advertised by a server, the smallest of all limits is kept
+    void set_max_chunk_size(std::size_t size);
+    std::size_t get_max_chunk_size();
+
+    void on_chunk_done(std::size_t bytes, int64_t latency_us);
+    void on_server_busy();
+
+private:
+    void end_round(int64_t now);
+    std::size_t align_chunk(std::size_t size) const;
+
+private:
+    AdaptiveParams params;
+
+    std::mutex mtx;
+    double parallel;
+    std::size_t chunk_size;
+
+    int64_t round_start;
+    std::size_t round_bytes;
+    int round_chunks;
+    int64_t round_latency;
+
+    double last_goodput;
+    double min_us_per_mb;
+};
+
+#endif // FCOPY_ADAPTIVE_CONTROLLER_H
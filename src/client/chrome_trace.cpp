@@ -0,0 +1,68 @@
+#include "client/chrome_trace.h"
+#include "common/utils.h"
+
+#include <cerrno>
+#include <cstdio>
+
+void ChromeTrace::set_process_name(int pid, const std::string &name) {
+    processes[pid] = name;
+}
+
+void ChromeTrace::add_spans(int pid, const std::string &file,
+                            const std::vector<TraceSpan> &spans) {
+    std::string file_str = json_quote(file);
+    char buf[256];
+
+    for (const TraceSpan &s : spans) {
+        std::string name = json_quote(s.name);
+
+        for (int end = 0; end < 2; end++) {
+            snprintf(buf, sizeof(buf),
+                "{\"ph\":\"%c\",\"cat\":\"chunk\",\"id\":\"0x%llx\",\"pid\":%d,\"tid\":0,"
+                "\"ts\":%lld,",
+                end ? 'e' : 'b', (unsigned long long)s.trace_id, pid,
+                (long long)(end ? s.start + s.dur : s.start));
+
+            std::string ev(buf);
+            ev.append("\"name\":").append(name);
+
+            if (!end) {
+                snprintf(buf, sizeof(buf), ",\"args\":{\"offset\":%llu,\"file\":",
+                         (unsigned long long)s.offset);
+                ev.append(buf).append(file_str).append("}");
+            }
+
+            ev.append("}");
+            events.push_back(std::move(ev));
+        }
+    }
+}
+
+int ChromeTrace::write(const std::string &path) const {
+    FILE *fp = fopen(path.c_str(), "w");
+    bool first = true;
+
+    if (!fp)
+        return errno;
+
+    fputs("{\"traceEvents\":[\n", fp);
+
+    for (const auto &it : processes) {
+        fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+                "\"args\":{\"name\":%s}}", first ? "" : ",\n", it.first,
+                json_quote(it.second).c_str());
+        first = false;
+    }
+
+    for (const std::string &ev : events) {
+        fprintf(fp, "%s%s", first ? "" : ",\n", ev.c_str());
+        first = false;
+    }
+
+    fputs("\n]}\n", fp);
+
+    if (fclose(fp) != 0)
+        return errno;
+
+    return 0;
+}
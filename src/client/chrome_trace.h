@@ -0,0 +1,28 @@
+#ifndef FCOPY_CHROME_TRACE_H
+#define FCOPY_CHROME_TRACE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/structures.h"
+
+// ChromeTrace merges spans of the client and all targets into one file of the
+// chrome trace event format, which chrome://tracing and perfetto open. Each
+// host is a process, and the spans of a chunk are async events with the
+// trace id, so phases running at the same time do not need to nest.
+class ChromeTrace {
+public:
+    // pid 0 is the client, and i+1 is the i-th target
+    void set_process_name(int pid, const std::string &name);
+    void add_spans(int pid, const std::string &file, const std::vector<TraceSpan> &spans);
+
+    // return 0 or errno
+    int write(const std::string &path) const;
+
+private:
+    std::map<int, std::string> processes;
+    std::vector<std::string> events;
+};
+
+#endif // FCOPY_CHROME_TRACE_H
@@ -1,13 +1,21 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <algorithm>
+#include <cctype>
 #include <fstream>
 #include <filesystem>
+#include <tuple>
 #include <getopt.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "coke/coke.h"
 #include "client/file_sender.h"
+#include "client/file_scanner.h"
+#include "client/chrome_trace.h"
+#include "client/transfer_report.h"
 #include "common/fcopy_log.h"
 #include "common/utils.h"
 
@@ -18,6 +26,25 @@ enum {
     DRY_RUN         = 0x0102,
     SEND_METHOD     = 0x0103,
     SPEED_LIMIT     = 0x0104,
+    ATOMIC          = 0x0105,
+    ATOMIC_DIR      = 0x0106,
+    SCHED_CLASS     = 0x0107,
+    SPEED_BURST     = 0x0108,
+    TARGET_SPEED_LIMIT = 0x0109,
+    MAX_PARALLEL    = 0x010A,
+    STREAMS         = 0x010B,
+    CONTROL_TIMEOUT = 0x010C,
+    POLLER_THREADS  = 0x010D,
+    HANDLER_THREADS = 0x010E,
+    NUMA_NODE       = 0x010F,
+    TRACE           = 0x0110,
+    TRACE_SAMPLE    = 0x0111,
+    PROGRESS        = 0x0112,
+    REPORT          = 0x0113,
+    SYNTHETIC       = 0x0114,
+    PARTITION       = 0x0115,
+    SCAN_THREADS    = 0x0116,
+    ORDER_WINDOW    = 0x0117,
 
     NO_WAIT_CLOSE   = 0x0200,
     WAIT_CLOSE      = 0x0201,
@@ -25,6 +52,9 @@ enum {
     DIRECT_IO       = 0x0203,
     NO_CHECK_SELF   = 0x0204,
     CHECK_SELF      = 0x0205,
+    ZERO_COPY       = 0x0206,
+    STATS           = 0x0207,
+    PHYSICAL_ORDER  = 0x0208,
 };
 
 const char *opts = "t:p:hv";
@@ -33,13 +63,35 @@ struct option long_opts[] = {
     {"target",          1, nullptr, 't'},
     {"target-list",     1, nullptr, TARGET_LIST},
     {"parallel",        1, nullptr, 'p'},
+    {"max-parallel",    1, nullptr, MAX_PARALLEL},
+    {"streams",         1, nullptr, STREAMS},
+    {"control-timeout", 1, nullptr, CONTROL_TIMEOUT},
+    {"poller-threads",  1, nullptr, POLLER_THREADS},
+    {"handler-threads", 1, nullptr, HANDLER_THREADS},
+    {"scan-threads",    1, nullptr, SCAN_THREADS},
+    {"numa-node",       1, nullptr, NUMA_NODE},
+    {"trace",           1, nullptr, TRACE},
+    {"trace-sample",    1, nullptr, TRACE_SAMPLE},
+    {"progress",        1, nullptr, PROGRESS},
+    {"report",          1, nullptr, REPORT},
+    {"synthetic",       1, nullptr, SYNTHETIC},
+    {"partition",       1, nullptr, PARTITION},
     {"dry-run",         0, nullptr, DRY_RUN},
     {"send-method",     1, nullptr, SEND_METHOD},
     {"speed-limit",     1, nullptr, SPEED_LIMIT},
+    {"speed-burst",     1, nullptr, SPEED_BURST},
+    {"target-speed-limit", 1, nullptr, TARGET_SPEED_LIMIT},
+    {"atomic",          0, nullptr, ATOMIC},
+    {"atomic-dir",      0, nullptr, ATOMIC_DIR},
+    {"sched-class",     1, nullptr, SCHED_CLASS},
     {"wait-close",      0, nullptr, WAIT_CLOSE},
     {"no-wait-close",   0, nullptr, NO_WAIT_CLOSE},
     {"direct-io",       0, nullptr, DIRECT_IO},
     {"no-direct-io",    0, nullptr, NO_DIRECT_IO},
+    {"zero-copy",       0, nullptr, ZERO_COPY},
+    {"stats",           0, nullptr, STATS},
+    {"physical-order",  0, nullptr, PHYSICAL_ORDER},
+    {"order-window",    1, nullptr, ORDER_WINDOW},
     {"check-self",      0, nullptr, CHECK_SELF},
     {"no-check-self",   0, nullptr, NO_CHECK_SELF},
     {"verbose",         0, nullptr, 'v'},
@@ -49,20 +101,59 @@ struct option long_opts[] = {
 
 struct GlobalConfig {
     int parallel = 1;
+    int max_parallel = 64;
+    int streams = 1;
+    // in ms, -1 means no timeout
+    int control_timeout = -1;
+    int poller_threads = 8;
+    int handler_threads = 12;
+    int scan_threads = 4;
+    // numa node number or network interface name
+    std::string numa_node;
+    // write spans of one of every trace_sample chunks to trace_file
+    std::string trace_file;
+    int trace_sample = 100;
+    // in seconds, 0 means no progress
+    double progress = 0;
+    // write a json report of the transfer to report_file
+    std::string report_file;
+    bool adaptive = false;
     int verbose = 0;
     bool dry_run = false;
+    bool stats = false;
     bool wait_close = true;
     bool direct_io = true;
+    bool zero_copy = false;
+    // send files and chunks in order of their location on disk, sorting
+    // order_window files at a time
+    bool physical_order = false;
+    int order_window = 1024;
     bool check_self = true;
+    bool atomic = false;
+    bool atomic_dir = false;
 
     int send_method = SEND_METHOD_CHAIN;
-    long speed_limit = 0;
+    // in MB
+    double speed_limit = 0;
+    double speed_burst = 0;
+    double target_speed_limit = 0;
+    // in MB, send generated files of this size instead of local files
+    double synthetic = 0;
+    std::string partition;
+    std::string sched_class;
     std::vector<RemoteTarget> targets;
+    // file and directory arguments, scanned while sending
+    std::vector<std::string> paths;
+    // synthetic files
     std::vector<FileDesc> files;
 };
 
 GlobalConfig cfg;
-coke::QpsPool speed_limiter(0);
+LinkRateLimiter speed_limiter;
+std::unique_ptr<AdaptiveController> controller;
+ChromeTrace trace;
+TransferProgress progress;
+TransferReport report;
 
 bool do_check_self() {
     std::vector<std::string> addrs;
@@ -95,13 +186,124 @@ bool do_check_self() {
     return true;
 }
 
-coke::Task<int> upload_file(FcopyClient &cli, SenderParams params) {
+// PhysicalOrder hands out files of the scanner sorted by their location on
+// disk, a window of files at a time. Files of different directory arguments
+// are not mixed, so --atomic-dir still sees them together.
+class PhysicalOrder {
+    // device, whether the physical address is known, then the address of
+    // the first extent or the inode number
+    using Key = std::tuple<uint64_t, int, uint64_t>;
+
+public:
+    PhysicalOrder(std::size_t window) : window(window) { }
+
+    bool next(FileDesc &file, FileScanner &scanner) {
+        if (pos == files.size())
+            fill(scanner);
+
+        if (pos == files.size())
+            return false;
+
+        file = std::move(files[pos++].second);
+        return true;
+    }
+
+private:
+    void fill(FileScanner &scanner) {
+        FileDesc file;
+
+        files.clear();
+        pos = 0;
+
+        if (has_held) {
+            files.emplace_back(get_key(held), std::move(held));
+            has_held = false;
+        }
+
+        while (files.size() < window && scanner.next(file)) {
+            if (!files.empty() && file.root != files.front().second.root) {
+                held = std::move(file);
+                has_held = true;
+                break;
+            }
+
+            files.emplace_back(get_key(file), std::move(file));
+        }
+
+        std::stable_sort(files.begin(), files.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+    }
+
+    static Key get_key(const FileDesc &file) {
+        std::vector<FileExtent> extents;
+        struct stat st;
+        Key key{0, 0, 0};
+        int fd;
+
+        fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return key;
+
+        if (fstat(fd, &st) == 0)
+            key = Key{st.st_dev, 0, st.st_ino};
+
+        if (get_file_extents(fd, 0, 1, extents) == 0 && !extents.empty() &&
+            extents[0].physical != 0)
+        {
+            std::get<1>(key) = 1;
+            std::get<2>(key) = extents[0].physical;
+        }
+
+        close(fd);
+        return key;
+    }
+
+private:
+    std::size_t window;
+    std::size_t pos{0};
+    std::vector<std::pair<Key, FileDesc>> files;
+    FileDesc held;
+    bool has_held{false};
+};
+
+bool scan_failed(const FileScanner &scanner) {
+    if (!scanner.failed())
+        return false;
+
+    const ScanError &e = scanner.get_error();
+    FLOG_ERROR("%s path:%s error:%d", e.msg.c_str(), e.path.c_str(), e.error);
+    return true;
+}
+
+void add_report(FileReport &frep, const FileSender &h, int64_t close_start, int error) {
+    progress.files_done.fetch_add(1, std::memory_order_relaxed);
+
+    if (cfg.report_file.empty())
+        return;
+
+    frep.error = error;
+    frep.close_us = current_usec() - close_start;
+    frep.chunks = h.get_acked_chunks();
+    frep.retries = h.get_retries();
+    frep.target_open_us = h.get_open_cost();
+    frep.target_close_us = h.get_close_cost();
+    report.add_file(std::move(frep));
+}
+
+coke::Task<int> upload_file(FcopyClient &cli, FcopyClient &ctrl_cli, SenderParams params) {
     FileSender h(cli, params);
+    FileReport frep;
+    int64_t start = current_usec();
     int error;
     int close_error;
 
+    h.set_control_client(&ctrl_cli);
     h.set_speed_limiter(&speed_limiter);
+    h.set_controller(controller.get());
+    h.set_progress(&progress);
     error = co_await h.create_file();
+    frep.create_us = current_usec() - start;
     if (error) {
         FLOG_ERROR("CreateFileError error:%d", error);
     }
@@ -119,16 +321,101 @@ coke::Task<int> upload_file(FcopyClient &cli, SenderParams params) {
         FLOG_INFO("Send Cost:%.4lf Speed:%s", cost, speed_str.c_str());
     }
 
+    frep.path = params.file_path;
+    frep.size = h.get_file_size();
+    frep.send_us = h.get_cost_us();
+    start = current_usec();
+
+    if (error && (params.atomic || !params.commit_dir.empty())) {
+        // do not publish a broken file
+        close_error = co_await h.delete_file();
+        if (close_error)
+            FLOG_ERROR("DeleteFileError error:%d", close_error);
+        else
+            FLOG_INFO("DeleteFileDone");
+
+        add_report(frep, h, start, error);
+        co_return error;
+    }
+
     close_error = co_await h.close_file();
     if (close_error)
         FLOG_ERROR("CloseFileError error:%d", close_error);
     else
         FLOG_INFO("CloseFileDone");
 
+    if (params.trace_sample > 0) {
+        const auto &target_spans = h.get_target_spans();
+
+        trace.add_spans(0, params.file_path, h.get_spans());
+        for (std::size_t i = 0; i < target_spans.size(); i++)
+            trace.add_spans((int)i + 1, params.file_path, target_spans[i]);
+    }
+
     if (error == 0)
-        co_return close_error;
-    else
-        co_return error;
+        error = close_error;
+
+    add_report(frep, h, start, error);
+    co_return error;
+}
+
+coke::Task<int> commit_dir(FcopyClient &cli, const std::string &dir, bool discard) {
+    int first_error = 0;
+    int error;
+
+    for (const RemoteTarget &target : cfg.targets) {
+        CommitDirReq req;
+        CommitDirResp resp;
+
+        req.discard = discard ? 1 : 0;
+        req.partition = cfg.partition;
+        req.commit_dir = dir;
+
+        error = co_await cli.request(target, std::move(req), resp);
+        if (error == 0)
+            error = resp.get_error();
+
+        if (error) {
+            FLOG_ERROR("CommitDirError dir:%s host:%s error:%d",
+                dir.c_str(), target.host.c_str(), error);
+
+            if (first_error == 0)
+                first_error = error;
+        }
+    }
+
+    if (first_error == 0)
+        FLOG_INFO("CommitDirDone dir:%s discard:%d", dir.c_str(), (int)discard);
+
+    co_return first_error;
+}
+
+coke::Task<int> show_stats(FcopyClient &cli) {
+    int first_error = 0;
+    int error;
+
+    for (const RemoteTarget &target : cfg.targets) {
+        StatsReq req;
+        StatsResp resp;
+
+        error = co_await cli.request(target, std::move(req), resp);
+        if (error == 0)
+            error = resp.get_error();
+
+        if (error) {
+            FLOG_ERROR("StatsError host:%s port:%u error:%d",
+                target.host.c_str(), (unsigned)target.port, error);
+
+            if (first_error == 0)
+                first_error = error;
+            continue;
+        }
+
+        fprintf(stdout, "# target %s:%u\n%s", target.host.c_str(),
+                (unsigned)target.port, resp.text.c_str());
+    }
+
+    co_return first_error;
 }
 
 void usage(const char *name) {
@@ -138,18 +425,58 @@ void usage(const char *name) {
         "                       add a file server target\n"
         "  --target-list file\n"
         "                       read target in `file`, one host:port per line\n\n"
-        "  -p, --parallel n     send in parallel, n in [1, 900], default 1\n\n"
+        "  -p, --parallel n     send in parallel, n in [1, 900], default 1, or auto to\n"
+        "                       tune parallel and chunk size during transfer\n\n"
+        "  --max-parallel n     max parallel of auto, n in [1, 900], default 64\n\n"
+        "  --streams n          split connections to each target into n streams,\n"
+        "                       each parallel worker sticks to one stream, default 1\n\n"
+        "  --control-timeout ms timeout of create, close and commit requests, which\n"
+        "                       use their own connections, default no timeout\n\n"
+        "  --poller-threads n   number of network threads, default 8\n\n"
+        "  --handler-threads n  number of handler threads, default 12\n\n"
+        "  --scan-threads n     number of threads reading directories, files are\n"
+        "                       sent while they are found, default 4\n\n"
+        "  --numa-node n|iface  run on cpus and prefer memory of numa node n, or of\n"
+        "                       the node of network interface iface\n\n"
+        "  --trace file         trace sampled chunks on client and targets, and write\n"
+        "                       the spans to file in chrome trace format\n\n"
+        "  --trace-sample n     trace one of every n chunks, default 100\n\n"
+        "  --progress sec       print acked bytes, rate, in flight bytes and eta\n"
+        "                       every sec seconds\n\n"
+        "  --report file        write per file and per target timings and chunk\n"
+        "                       latency percentiles to file in json\n\n"
         "  --send-method m      send with method, support chain, tree\n\n"
         "  --speed-limit n      set the maximum transfer rate in MB\n\n"
+        "  --speed-burst n      set the maximum burst above the rate in MB, default\n"
+        "                       a tenth of the rate\n\n"
+        "  --target-speed-limit n\n"
+        "                       set the maximum transfer rate to each target in MB\n\n"
+        "  --sched-class name   schedule the transfer in class `name` on servers\n\n"
+        "  --partition name     write to partition `name` on servers instead of the\n"
+        "                       default partition\n\n"
+        "  --synthetic n        send generated data of n MB for each FILE argument,\n"
+        "                       which is only the remote name, instead of reading files\n\n"
+        "  --atomic             write to temp file and rename it to the target when\n"
+        "                       closed, remove it if transfer failed\n\n"
+        "  --atomic-dir         like --atomic, but publish each directory argument\n"
+        "                       as a whole after all its files are sent\n\n"
         "  --wait-close, --no-wait-close\n"
         "                       whether wait server finish close file, default wait\n\n"
         "  --direct-io, --no-direct-io\n"
         "                       enable/disable direct io when read file, default enable\n\n"
+        "  --zero-copy          with --no-direct-io, send from the mapped file instead\n"
+        "                       of reading it into buffers, files must not be\n"
+        "                       truncated during transfer\n\n"
+        "  --physical-order     send files, and chunks of fragmented files, in order\n"
+        "                       of their location on disk, for rotational disks\n\n"
+        "  --order-window n     with --physical-order, sort n files at a time,\n"
+        "                       default 1024\n\n"
         "  --check-self, --no-check-self\n"
         "                       enable/disable check, Abort transfer if targets include\n"
         "                       self or duplicate, default enable\n\n"
         "  --dry-run            parse parameters, determine file, but do not perform the\n"
         "                       upload\n\n"
+        "  --stats              print metrics of the targets instead of sending files\n\n"
         "  -v, --verbose        show more details\n"
         "  -h, --help           show this page\n"
     , name);
@@ -218,7 +545,70 @@ int parse_args(int argc, char *argv[]) {
 
         switch (copt) {
         case 'p':
-            cfg.parallel = std::atoi(arg);
+            if (std::string(arg) == "auto")
+                cfg.adaptive = true;
+            else
+                cfg.parallel = std::atoi(arg);
+            break;
+
+        case MAX_PARALLEL:
+            cfg.max_parallel = std::atoi(arg);
+            break;
+
+        case STREAMS:
+            cfg.streams = std::atoi(arg);
+            break;
+
+        case CONTROL_TIMEOUT:
+            cfg.control_timeout = std::atoi(arg);
+            break;
+
+        case POLLER_THREADS:
+            cfg.poller_threads = std::atoi(arg);
+            break;
+
+        case HANDLER_THREADS:
+            cfg.handler_threads = std::atoi(arg);
+            break;
+
+        case SCAN_THREADS:
+            cfg.scan_threads = std::atoi(arg);
+            break;
+
+        case NUMA_NODE:
+            cfg.numa_node.assign(arg);
+            break;
+
+        case TRACE:
+            cfg.trace_file.assign(arg);
+            break;
+
+        case PROGRESS:
+            cfg.progress = std::atof(arg);
+            if (cfg.progress <= 0) {
+                FLOG_ERROR("Invalid progress interval %s", arg);
+                return 1;
+            }
+            break;
+
+        case REPORT:
+            cfg.report_file.assign(arg);
+            break;
+
+        case ORDER_WINDOW:
+            cfg.order_window = std::atoi(arg);
+            if (cfg.order_window <= 0) {
+                FLOG_ERROR("Invalid order window %s", arg);
+                return 1;
+            }
+            break;
+
+        case TRACE_SAMPLE:
+            cfg.trace_sample = std::atoi(arg);
+            if (cfg.trace_sample <= 0) {
+                FLOG_ERROR("Invalid trace sample %s", arg);
+                return 1;
+            }
             break;
 
         case 't':
@@ -248,18 +638,51 @@ int parse_args(int argc, char *argv[]) {
             break;
 
         case SPEED_LIMIT:
-            cfg.speed_limit = std::atol(arg);
+            cfg.speed_limit = std::atof(arg);
             if (cfg.speed_limit <= 0) {
-                FLOG_ERROR("Invalid speed limit %ld\n", cfg.speed_limit);
+                FLOG_ERROR("Invalid speed limit %s", arg);
+                return 1;
+            }
+            break;
+
+        case SPEED_BURST:
+            cfg.speed_burst = std::atof(arg);
+            if (cfg.speed_burst <= 0) {
+                FLOG_ERROR("Invalid speed burst %s", arg);
+                return 1;
+            }
+            break;
+
+        case TARGET_SPEED_LIMIT:
+            cfg.target_speed_limit = std::atof(arg);
+            if (cfg.target_speed_limit <= 0) {
+                FLOG_ERROR("Invalid target speed limit %s", arg);
+                return 1;
+            }
+            break;
+
+        case SYNTHETIC:
+            cfg.synthetic = std::atof(arg);
+            if (cfg.synthetic <= 0) {
+                FLOG_ERROR("Invalid synthetic size %s", arg);
                 return 1;
             }
             break;
 
+        case SCHED_CLASS:   cfg.sched_class.assign(arg); break;
+        case PARTITION:     cfg.partition.assign(arg); break;
+
+        case ATOMIC:        cfg.atomic = true; break;
+        case ATOMIC_DIR:    cfg.atomic_dir = true; cfg.atomic = true; break;
+
         case WAIT_CLOSE:    cfg.wait_close = true; break;
         case NO_WAIT_CLOSE: cfg.wait_close = false; break;
 
         case DIRECT_IO:     cfg.direct_io = true; break;
         case NO_DIRECT_IO:  cfg.direct_io = false; break;
+        case ZERO_COPY:     cfg.zero_copy = true; break;
+        case STATS:         cfg.stats = true; break;
+        case PHYSICAL_ORDER: cfg.physical_order = true; break;
 
         case CHECK_SELF:    cfg.check_self = true; break;
         case NO_CHECK_SELF: cfg.check_self = false; break;
@@ -278,14 +701,25 @@ int parse_args(int argc, char *argv[]) {
             paths.push_back(argv[i]);
     }
 
-    try {
-        load_files(paths, cfg.files);
-    }
-    catch (const fs::filesystem_error &e) {
-        FLOG_ERROR("%s path:%s error:%d", e.what(), e.path1().c_str(), e.code().value());
-        return 1;
+    if (cfg.synthetic > 0) {
+        constexpr double MB = 1024 * 1024;
+
+        if (paths.empty())
+            paths.push_back("synthetic");
+
+        for (const std::string &path : paths) {
+            FileDesc file;
+            file.name = fs::path(path).filename().string();
+            file.path = path;
+            file.fullpath = path;
+            file.size = std::max<std::size_t>((std::size_t)(cfg.synthetic * MB), 1);
+            cfg.files.push_back(std::move(file));
+        }
+
+        return 0;
     }
 
+    cfg.paths = std::move(paths);
     return 0;
 }
 
@@ -301,6 +735,9 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (cfg.adaptive)
+        cfg.parallel = cfg.max_parallel;
+
     if (cfg.parallel < 1)
         cfg.parallel = 1;
     else if (cfg.parallel > 900)
@@ -309,28 +746,133 @@ int main(int argc, char *argv[]) {
     if (cfg.check_self && !do_check_self())
         return -1;
 
-    if (cfg.dry_run)
-        return 0;
+    ScanParams scan_params;
+    scan_params.threads = cfg.scan_threads;
+    scan_params.on_found = [](const FileDesc &file) {
+        progress.total_bytes.fetch_add(file.size, std::memory_order_relaxed);
+        progress.total_files.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    FileScanner scanner(scan_params);
+
+    if (cfg.dry_run) {
+        FileDesc file;
+
+        scanner.start(cfg.paths);
+        while (scanner.next(file))
+            continue;
+
+        return scan_failed(scanner) ? 1 : 0;
+    }
+
+    if (!cfg.numa_node.empty()) {
+        int node;
+
+        if (std::isdigit((unsigned char)cfg.numa_node[0]))
+            node = std::atoi(cfg.numa_node.c_str());
+        else
+            node = get_iface_numa_node(cfg.numa_node);
+
+        // threads started by coke inherit the binding
+        int ret = (node >= 0) ? bind_numa_node(node) : ENOENT;
+        if (ret != 0)
+            FLOG_WARN("BindNumaNodeFailed node:%s error:%d", cfg.numa_node.c_str(), ret);
+    }
 
     // coke global init
     coke::GlobalSettings settings;
     settings.endpoint_params.max_connections = 4096;
-    settings.poller_threads = 8;
-    settings.handler_threads = 12;
+    settings.poller_threads = std::max(cfg.poller_threads, 1);
+    settings.handler_threads = std::max(cfg.handler_threads, 1);
     coke::library_init(settings);
 
-    speed_limiter.reset_qps(cfg.speed_limit);
+    constexpr double MB = 1024 * 1024;
+    LinkRateParams rate_params;
+    rate_params.rate = (std::size_t)(cfg.speed_limit * MB);
+    rate_params.burst = (std::size_t)(cfg.speed_burst * MB);
+    rate_params.link_rate = (std::size_t)(cfg.target_speed_limit * MB);
+    rate_params.link_burst = rate_params.burst;
+    speed_limiter.set_params(rate_params);
+
+    if (cfg.adaptive) {
+        AdaptiveParams adaptive_params;
+        adaptive_params.max_parallel = cfg.parallel;
+        controller = std::make_unique<AdaptiveController>(adaptive_params);
+    }
+
+    // resolve targets once, every file and chunk reuses the address
+    for (RemoteTarget &target : cfg.targets) {
+        if (!resolve_target(target)) {
+            FLOG_WARN("ResolveTarget Failed host:%s port:%u",
+                target.host.c_str(), (unsigned)target.port);
+        }
+    }
 
     FcopyClientParams cli_params;
     cli_params.retry_max = 2;
+    cli_params.streams = std::clamp(cfg.streams, 1, cfg.parallel);
+
+    FcopyClientParams ctrl_params;
+    ctrl_params.retry_max = 2;
+    ctrl_params.send_timeout = cfg.control_timeout;
+    ctrl_params.receive_timeout = cfg.control_timeout;
+    ctrl_params.lane = "control";
 
     FcopyClient cli(cli_params);
-    int error;
+    FcopyClient ctrl_cli(ctrl_params);
+    std::string cur_root;
+    int commit_error = 0;
+    int error = 0;
+
+    if (cfg.stats)
+        return coke::sync_wait(show_stats(ctrl_cli)) ? 1 : 0;
+
+    for (const FileDesc &file : cfg.files)
+        progress.total_bytes += file.size;
+    progress.total_files += (int)cfg.files.size();
+
+    // synthetic files are known upfront, others are sent as they are found
+    std::size_t next_synthetic = 0;
+    PhysicalOrder orderer(cfg.order_window);
+    auto next_file = [&](FileDesc &file) {
+        if (next_synthetic < cfg.files.size()) {
+            file = cfg.files[next_synthetic++];
+            return true;
+        }
+
+        if (cfg.physical_order)
+            return orderer.next(file, scanner) && !scanner.failed();
+
+        return scanner.next(file);
+    };
+
+    scanner.start(cfg.paths);
+
+    ProgressPrinter printer(progress);
+    int64_t start = current_usec();
+
+    if (cfg.progress > 0)
+        printer.start(std::max((int)(cfg.progress * 1000), 1));
+
+    FileDesc file;
+    while (next_file(file)) {
+        if (cfg.atomic_dir && file.root != cur_root) {
+            if (!cur_root.empty())
+                error = coke::sync_wait(commit_dir(ctrl_cli, cur_root, false));
+
+            if (error) {
+                commit_error = error;
+                cur_root.clear();
+                break;
+            }
+
+            cur_root = file.root;
+        }
 
-    for (const FileDesc &file : cfg.files) {
         SenderParams params;
         params.file_path = file.path;
-        params.partition = "";
+        params.partition = cfg.partition;
+        params.sched_class = cfg.sched_class;
         params.remote_file_dir = ".";
         params.remote_file_name = file.path;
         params.targets = cfg.targets;
@@ -338,12 +880,51 @@ int main(int argc, char *argv[]) {
         params.send_method = cfg.send_method;
 
         params.direct_io = cfg.direct_io;
+        params.zero_copy = cfg.zero_copy;
+        params.physical_order = cfg.physical_order;
+        params.synthetic_size = cfg.synthetic > 0 ? file.size : 0;
         params.wait_close = cfg.wait_close;
+        params.atomic = cfg.atomic;
+        params.trace_sample = cfg.trace_file.empty() ? 0 : cfg.trace_sample;
+
+        if (cfg.atomic_dir && !file.root.empty()) {
+            // files must be closed before commit
+            params.commit_dir = file.root;
+            params.wait_close = true;
+        }
 
-        error = coke::sync_wait(upload_file(cli, params));
+        error = coke::sync_wait(upload_file(cli, ctrl_cli, params));
         if (error)
             break;
     }
 
-    return 0;
+    // a directory is incomplete if scanning it failed
+    scanner.stop();
+    bool scan_error = scan_failed(scanner);
+
+    if (!cur_root.empty())
+        commit_error = coke::sync_wait(commit_dir(ctrl_cli, cur_root, error != 0 || scan_error));
+
+    printer.stop();
+
+    if (!cfg.report_file.empty()) {
+        int ret = report.write(cfg.report_file, cfg.targets, progress, current_usec() - start);
+        if (ret != 0)
+            FLOG_ERROR("WriteReportFailed file:%s error:%d", cfg.report_file.c_str(), ret);
+    }
+
+    if (!cfg.trace_file.empty()) {
+        trace.set_process_name(0, "client");
+        for (std::size_t i = 0; i < cfg.targets.size(); i++) {
+            const RemoteTarget &t = cfg.targets[i];
+            trace.set_process_name((int)i + 1, t.host + ":" + std::to_string(t.port));
+        }
+
+        int ret = trace.write(cfg.trace_file);
+        if (ret != 0)
+            FLOG_ERROR("WriteTraceFailed file:%s error:%d", cfg.trace_file.c_str(), ret);
+    }
+
+    // a directory that is not committed is missing on the targets
+    return (scan_error || commit_error) ? 1 : 0;
 }
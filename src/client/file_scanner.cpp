@@ -0,0 +1,467 @@
+#include "client/file_scanner.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common/fcopy_log.h"
+
+namespace {
+
+constexpr std::size_t DENTS_BUF_SIZE = 64 * 1024;
+constexpr std::size_t EMIT_BATCH = 64;
+
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+std::string join_path(const std::string &dir, const std::string &name) {
+    if (dir.empty())
+        return name;
+    if (name.empty())
+        return dir;
+    if (dir.back() == '/')
+        return dir + name;
+    return dir + "/" + name;
+}
+
+std::string real_path(const std::string &path) {
+    char buf[PATH_MAX];
+
+    if (realpath(path.c_str(), buf) == nullptr)
+        return path;
+    return buf;
+}
+
+std::string parent_path(const std::string &path) {
+    std::size_t pos = path.find_last_of('/');
+
+    if (pos == std::string::npos)
+        return ".";
+    if (pos == 0)
+        return "/";
+    return path.substr(0, pos);
+}
+
+} // namespace
+
+// A queued directory only keeps its own name, the path is rebuilt from the
+// parents when it is read.
+struct FileScanner::DirNode {
+    std::shared_ptr<DirNode> parent;
+    std::string name;
+    int depth;
+
+    // path relative to the argument, empty for the argument itself
+    std::string rel_path() const {
+        std::vector<const DirNode *> nodes;
+        std::string rel;
+
+        for (const DirNode *p = this; p->parent; p = p->parent.get())
+            nodes.push_back(p);
+
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+            rel = join_path(rel, (*it)->name);
+        return rel;
+    }
+};
+
+struct FileScanner::Worker {
+    std::mutex mtx;
+    std::deque<std::shared_ptr<DirNode>> dirs;
+    std::unique_ptr<char[]> buf;
+    std::thread thread;
+};
+
+FileScanner::FileScanner(const ScanParams &params) : params(params) {
+    this->params.threads = std::max(this->params.threads, 1);
+    this->params.queue_size = std::max<std::size_t>(this->params.queue_size, 1);
+}
+
+FileScanner::~FileScanner() {
+    stop();
+}
+
+void FileScanner::start(std::vector<std::string> paths) {
+    runner = std::thread(&FileScanner::run, this, std::move(paths));
+}
+
+bool FileScanner::next(FileDesc &file) {
+    std::unique_lock<std::mutex> lk(out_mtx);
+
+    out_cv.wait(lk, [this] { return !out.empty() || finished || failed(); });
+
+    if (failed() || out.empty())
+        return false;
+
+    file = std::move(out.front());
+    out.pop_front();
+    space_cv.notify_one();
+    return true;
+}
+
+void FileScanner::stop() {
+    stopping.store(true, std::memory_order_release);
+
+    {
+        std::lock_guard<std::mutex> lg(out_mtx);
+        out_cv.notify_all();
+        space_cv.notify_all();
+    }
+
+    if (runner.joinable())
+        runner.join();
+}
+
+void FileScanner::run(std::vector<std::string> paths) {
+    for (int i = 0; i < params.threads; i++) {
+        auto w = std::make_unique<Worker>();
+        w->buf.reset(new char[DENTS_BUF_SIZE]);
+        workers.push_back(std::move(w));
+    }
+
+    for (std::size_t i = 0; i < workers.size(); i++)
+        workers[i]->thread = std::thread(&FileScanner::work, this, i);
+
+    for (const std::string &path : paths) {
+        if (stopped())
+            break;
+        scan_root(path);
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(work_mtx);
+        quit = true;
+        work_cv.notify_all();
+    }
+
+    for (auto &w : workers)
+        w->thread.join();
+
+    std::lock_guard<std::mutex> lg(out_mtx);
+    finished = true;
+    out_cv.notify_all();
+}
+
+void FileScanner::scan_root(const std::string &path) {
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0) {
+        set_error("Stat file failed", path, errno);
+        return;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        root.clear();
+        real_root.clear();
+
+        std::vector<FileDesc> batch;
+        std::size_t pos = path.find_last_of('/');
+
+        if (pos == std::string::npos)
+            add_file("", "", path.c_str(), st, true, batch);
+        else
+            add_file(pos == 0 ? "/" : path.substr(0, pos), "",
+                     path.c_str() + pos + 1, st, true, batch);
+
+        emit(batch);
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        set_error("Unsupported file type", path, 0);
+        return;
+    }
+
+    if (!add_dir_id(st.st_dev, st.st_ino, path))
+        return;
+
+    root = path;
+    real_root = real_path(path);
+
+    auto node = std::make_shared<DirNode>();
+    node->name = path;
+    node->depth = 1;
+    push_dir(0, std::move(node));
+
+    std::unique_lock<std::mutex> lk(work_mtx);
+    done_cv.wait(lk, [this] { return pending.load(std::memory_order_acquire) == 0; });
+}
+
+void FileScanner::work(std::size_t idx) {
+    while (true) {
+        uint64_t seq = dir_seq.load(std::memory_order_acquire);
+        std::shared_ptr<DirNode> dir = take_dir(idx);
+
+        if (dir) {
+            scan_dir(idx, dir);
+            dir.reset();
+
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> lg(work_mtx);
+                done_cv.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(work_mtx);
+        work_cv.wait(lk, [&] {
+            return quit || dir_seq.load(std::memory_order_acquire) != seq;
+        });
+
+        if (quit)
+            return;
+    }
+}
+
+std::shared_ptr<FileScanner::DirNode> FileScanner::take_dir(std::size_t idx) {
+    std::shared_ptr<DirNode> dir;
+    std::size_t n = workers.size();
+
+    // newest of its own for depth first order, oldest of others to steal
+    // large subtrees
+    for (std::size_t k = 0; k < n && !dir; k++) {
+        Worker &w = *workers[(idx + k) % n];
+        std::lock_guard<std::mutex> lg(w.mtx);
+
+        if (w.dirs.empty())
+            continue;
+
+        if (k == 0) {
+            dir = std::move(w.dirs.back());
+            w.dirs.pop_back();
+        }
+        else {
+            dir = std::move(w.dirs.front());
+            w.dirs.pop_front();
+        }
+    }
+
+    return dir;
+}
+
+void FileScanner::push_dir(std::size_t idx, std::shared_ptr<DirNode> dir) {
+    Worker &w = *workers[idx];
+
+    pending.fetch_add(1, std::memory_order_acq_rel);
+    {
+        std::lock_guard<std::mutex> lg(w.mtx);
+        w.dirs.push_back(std::move(dir));
+    }
+
+    dir_seq.fetch_add(1, std::memory_order_acq_rel);
+
+    std::lock_guard<std::mutex> lg(work_mtx);
+    work_cv.notify_one();
+}
+
+void FileScanner::scan_dir(std::size_t idx, const std::shared_ptr<DirNode> &dir) {
+    if (stopped())
+        return;
+
+    std::string rel = dir->rel_path();
+    std::string path = join_path(root, rel);
+    std::string real_dir = join_path(real_root, rel);
+    std::vector<FileDesc> batch;
+    char *buf = workers[idx]->buf.get();
+    struct stat st;
+    long nread;
+    int fd;
+
+    if (dir->depth > params.max_depth) {
+        set_error("Traversing folders encountered maximum depth", path, 0);
+        return;
+    }
+
+    fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        set_error("Open directory failed", path, errno);
+        return;
+    }
+
+    // the argument itself is checked by scan_root
+    if (dir->parent) {
+        if (fstat(fd, &st) != 0) {
+            set_error("Stat file failed", path, errno);
+            close(fd);
+            return;
+        }
+
+        if (!add_dir_id(st.st_dev, st.st_ino, path)) {
+            close(fd);
+            return;
+        }
+    }
+
+    while ((nread = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZE)) > 0) {
+        for (long pos = 0; pos < nread && !stopped(); ) {
+            auto *d = (LinuxDirent64 *)(buf + pos);
+            const char *name = d->d_name;
+            pos += d->d_reclen;
+
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            if (d->d_type == DT_DIR) {
+                auto node = std::make_shared<DirNode>();
+                node->parent = dir;
+                node->name = name;
+                node->depth = dir->depth + 1;
+                push_dir(idx, std::move(node));
+                continue;
+            }
+
+            // follow symbolic links as the argument would be, the type is
+            // unknown on some file systems
+            bool link = (d->d_type == DT_LNK);
+            int ret = fstatat(fd, name, &st, link ? 0 : AT_SYMLINK_NOFOLLOW);
+
+            if (ret == 0 && !link && S_ISLNK(st.st_mode)) {
+                link = true;
+                ret = fstatat(fd, name, &st, 0);
+            }
+
+            if (ret != 0) {
+                set_error("Stat file failed", join_path(path, name), errno);
+                break;
+            }
+
+            if (S_ISDIR(st.st_mode)) {
+                auto node = std::make_shared<DirNode>();
+                node->parent = dir;
+                node->name = name;
+                node->depth = dir->depth + 1;
+                push_dir(idx, std::move(node));
+            }
+            else if (S_ISREG(st.st_mode))
+                add_file(path, real_dir, name, st, link, batch);
+            else
+                set_error("Unsupported file type", join_path(path, name), 0);
+        }
+
+        // hand out in batches, a lock and wakeup per file costs more than
+        // reading the directory
+        if (batch.size() >= EMIT_BATCH)
+            emit(batch);
+
+        if (stopped())
+            break;
+    }
+
+    emit(batch);
+
+    if (nread < 0)
+        set_error("Read directory failed", path, errno);
+
+    close(fd);
+}
+
+bool FileScanner::add_dir_id(dev_t dev, ino_t ino, const std::string &path) {
+    std::lock_guard<std::mutex> lg(id_mtx);
+
+    if (!dir_ids.emplace(dev, ino).second) {
+        set_error("Duplicate files", path, 0);
+        return false;
+    }
+
+    return true;
+}
+
+bool FileScanner::add_file(const std::string &dir, const std::string &real_dir,
+                           const char *name, const struct stat &st, bool loose,
+                           std::vector<FileDesc> &batch)
+{
+    FileDesc desc;
+
+    desc.name = name;
+    desc.dir = dir;
+    desc.path = join_path(dir, name);
+    desc.root = root;
+    desc.size = st.st_size;
+
+    if (loose)
+        desc.fullpath = real_path(desc.path);
+    else
+        desc.fullpath = join_path(real_dir, name);
+
+    // a file given directly or through a link is checked against the
+    // directories read so far and the other way round, files inside
+    // directories only need to be checked when such files exist
+    if (loose || has_loose.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lg(id_mtx);
+        auto id = std::make_pair(st.st_dev, st.st_ino);
+        bool dup;
+
+        if (loose) {
+            struct stat pst;
+            std::string parent = parent_path(desc.fullpath);
+
+            dup = !loose_ids.insert(id).second;
+            if (!dup && stat(parent.c_str(), &pst) == 0)
+                dup = dir_ids.count({pst.st_dev, pst.st_ino}) != 0;
+            has_loose.store(true, std::memory_order_release);
+        }
+        else
+            dup = loose_ids.count(id) != 0;
+
+        if (dup) {
+            set_error("Duplicate files", desc.path, 0);
+            return false;
+        }
+    }
+
+    FLOG_INFO("FindFile size:%zu path:%s realpath:%s",
+        desc.size, desc.path.c_str(), desc.fullpath.c_str());
+
+    if (params.on_found)
+        params.on_found(desc);
+
+    batch.push_back(std::move(desc));
+    return true;
+}
+
+void FileScanner::emit(std::vector<FileDesc> &batch) {
+    if (batch.empty())
+        return;
+
+    std::unique_lock<std::mutex> lk(out_mtx);
+    space_cv.wait(lk, [this] {
+        return out.size() < params.queue_size || stopped();
+    });
+
+    if (!stopped()) {
+        bool was_empty = out.empty();
+
+        for (FileDesc &desc : batch)
+            out.push_back(std::move(desc));
+
+        if (was_empty)
+            out_cv.notify_one();
+    }
+
+    batch.clear();
+}
+
+void FileScanner::set_error(const char *msg, const std::string &path, int err) {
+    std::lock_guard<std::mutex> lg(out_mtx);
+
+    if (!failed()) {
+        error.msg = msg;
+        error.path = path;
+        error.error = err;
+        has_error.store(true, std::memory_order_release);
+    }
+
+    out_cv.notify_all();
+    space_cv.notify_all();
+}
@@ -0,0 +1,123 @@
+#ifndef FCOPY_FILE_SCANNER_H
+#define FCOPY_FILE_SCANNER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+#include "common/utils.h"
+
+struct ScanParams {
+    int threads = 4;
+    int max_depth = 16;
+
+    // files found but not taken by next() yet, scanning pauses when full
+    std::size_t queue_size = 4096;
+
+    // called in scanning threads for each file found
+    std::function<void(const FileDesc &)> on_found;
+};
+
+struct ScanError {
+    std::string msg;
+    std::string path;
+    int error = 0;
+};
+
+/**
+ * FileScanner walks the file and directory arguments in background threads
+ * and hands out files as they are found. Arguments are scanned one after
+ * another, so files of a directory argument are contiguous; inside one
+ * argument the directories are read with getdents64 by all threads, each
+ * taking directories from its own queue and stealing from the others when
+ * it runs out.
+ */
+class FileScanner {
+    struct DirNode;
+    struct Worker;
+
+public:
+    FileScanner(const ScanParams &params);
+    ~FileScanner();
+
+    FileScanner(const FileScanner &) = delete;
+    FileScanner &operator= (const FileScanner &) = delete;
+
+    void start(std::vector<std::string> paths);
+
+    // wait for the next file, return false when all are found or on error
+    bool next(FileDesc &file);
+
+    // stop scanning, files not taken yet are discarded
+    void stop();
+
+    bool failed() const { return has_error.load(std::memory_order_acquire); }
+    const ScanError &get_error() const { return error; }
+
+private:
+    void run(std::vector<std::string> paths);
+    void scan_root(const std::string &path);
+    void work(std::size_t idx);
+
+    std::shared_ptr<DirNode> take_dir(std::size_t idx);
+    void push_dir(std::size_t idx, std::shared_ptr<DirNode> dir);
+    void scan_dir(std::size_t idx, const std::shared_ptr<DirNode> &dir);
+
+    bool add_dir_id(dev_t dev, ino_t ino, const std::string &path);
+    bool add_file(const std::string &dir, const std::string &real_dir,
+                  const char *name, const struct stat &st, bool loose,
+                  std::vector<FileDesc> &batch);
+    void emit(std::vector<FileDesc> &batch);
+    void set_error(const char *msg, const std::string &path, int err);
+
+    bool stopped() const {
+        return has_error.load(std::memory_order_acquire) ||
+               stopping.load(std::memory_order_acquire);
+    }
+
+private:
+    ScanParams params;
+
+    std::string root;
+    std::string real_root;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::thread runner;
+
+    // directories queued or being read in the current argument
+    std::atomic<std::size_t> pending{0};
+    std::atomic<uint64_t> dir_seq{0};
+    std::atomic<bool> stopping{false};
+    bool quit{false};
+    std::mutex work_mtx;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+
+    // (dev, ino) of directories, and of files not found by reading a
+    // directory, for duplicate detection without keeping every path
+    std::mutex id_mtx;
+    std::set<std::pair<dev_t, ino_t>> dir_ids;
+    std::set<std::pair<dev_t, ino_t>> loose_ids;
+    std::atomic<bool> has_loose{false};
+
+    std::mutex out_mtx;
+    std::condition_variable out_cv;
+    std::condition_variable space_cv;
+    std::deque<FileDesc> out;
+    bool finished{false};
+
+    std::atomic<bool> has_error{false};
+    ScanError error;
+};
+
+#endif // FCOPY_FILE_SCANNER_H
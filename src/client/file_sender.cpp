@@ -1,16 +1,22 @@
 #include <cstdlib>
 #include <memory>
+#include <algorithm>
+#include <random>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "client/file_sender.h"
 #include "common/structures.h"
 #include "common/utils.h"
+#include "common/error_code.h"
 
 #include "coke/global.h"
 #include "coke/fileio.h"
 #include "coke/wait.h"
+#include "coke/sleep.h"
+#include "coke/go.h"
 
 static int open_file(const std::string &path, uint64_t &file_size, int flag) {
     struct stat file_stat;
@@ -25,42 +31,113 @@ static int open_file(const std::string &path, uint64_t &file_size, int flag) {
     return fd;
 }
 
+// fault in the pages of a mapped chunk, so that the poller threads do not
+// block on disk when sending it
+static void prefault(const char *p, std::size_t size) {
+#ifdef MADV_POPULATE_READ
+    if (madvise(const_cast<char *>(p), size, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+
+    volatile char c;
+    for (std::size_t i = 0; i < size; i += 4096)
+        c = p[i];
+    (void)c;
+}
+
+static uint64_t synthetic_word(uint64_t i) {
+    // splitmix64
+    uint64_t z = i + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+std::shared_ptr<char> FileSender::get_synthetic(std::size_t size) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    // grows at most a few times with the chunk size, chunks in flight keep
+    // the old buffer
+    if (synthetic_len < SYNTHETIC_PERIOD + size) {
+        std::size_t len = SYNTHETIC_PERIOD + size;
+        len = (len + FCOPY_CHUNK_BASE - 1) / FCOPY_CHUNK_BASE * FCOPY_CHUNK_BASE;
+
+        uint64_t *p = static_cast<uint64_t *>(std::aligned_alloc(FCOPY_CHUNK_BASE, len));
+        if (p == nullptr)
+            return nullptr;
+
+        std::size_t period = SYNTHETIC_PERIOD / sizeof(uint64_t);
+        for (std::size_t i = 0; i < len / sizeof(uint64_t); i++)
+            p[i] = synthetic_word(i % period);
+
+        synthetic.reset(reinterpret_cast<char *>(p), std::free);
+        synthetic_len = len;
+    }
+
+    return synthetic;
+}
+
 coke::Task<int> FileSender::create_file() {
     int iflag = O_RDONLY;
     if (params.direct_io)
         iflag |= O_DIRECT;
 
-    if (fd < 0)
+    if (params.synthetic_size > 0)
+        file_size = params.synthetic_size;
+    else if (fd < 0)
         fd = open_file(params.file_path, file_size, iflag);
 
-    if (fd < 0) {
+    if (fd < 0 && params.synthetic_size == 0) {
         error = errno;
         co_return error;
     }
 
+    if (params.zero_copy && !params.direct_io && !map && file_size > 0) {
+        void *p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        // fall back to read if the file cannot be mapped
+        if (p != MAP_FAILED) {
+            madvise(p, file_size, MADV_SEQUENTIAL);
+            map = static_cast<char *>(p);
+        }
+    }
+
+    if (params.physical_order && fd >= 0)
+        init_chunk_order();
+
     error = co_await remote_open();
     if (error)
         co_return error;
 
-    if (params.send_method == SEND_METHOD_TREE) {
-        error = co_await set_send_tree();
-    }
-    else {
-        error = co_await set_send_chain();
-    }
-
+    error = co_await set_send_layout();
     co_return error;
 }
 
 coke::Task<int> FileSender::close_file() {
+    if (params.trace_sample > 0)
+        co_await fetch_spans();
+
     error = co_await remote_close();
+    close_local();
+    co_return error;
+}
+
+coke::Task<int> FileSender::delete_file() {
+    error = co_await remote_delete();
+    close_local();
+    co_return error;
+}
+
+void FileSender::close_local() {
+    if (map) {
+        munmap(map, file_size);
+        map = nullptr;
+    }
 
     if (fd > 0) {
         close(fd);
         fd = -1;
     }
-
-    co_return error;
 }
 
 coke::Task<int> FileSender::send_file() {
@@ -68,66 +145,291 @@ coke::Task<int> FileSender::send_file() {
 
     cur_offset = 0;
     error = 0;
+    acked_chunks = 0;
+    retries = 0;
 
     std::vector<coke::Task<>> tasks;
     tasks.reserve(params.parallel);
 
     for (int i = 0; i < params.parallel; i++)
-        tasks.emplace_back(parallel_send(params.targets[0], file_tokens[0]));
+        tasks.emplace_back(parallel_send(i, params.targets[0], file_tokens[0]));
 
     co_await coke::async_wait(std::move(tasks));
     send_cost = current_usec() - start;
     co_return error;
 }
 
-coke::Task<> FileSender::parallel_send(RemoteTarget target, std::string token) {
+uint64_t FileSender::next_trace_id() {
+    static std::atomic<uint64_t> next_id = [] {
+        std::random_device rd;
+        return ((uint64_t)rd() << 32) | rd();
+    }();
+
+    if (params.trace_sample <= 0)
+        return 0;
+
+    uint64_t seq = chunk_seq.fetch_add(1, std::memory_order_relaxed);
+    if (seq % params.trace_sample != 0)
+        return 0;
+
+    uint64_t id = next_id.fetch_add(1);
+    return id ? id : next_id.fetch_add(1);
+}
+
+void FileSender::add_span(uint64_t trace_id, uint64_t offset, const char *name,
+                          int64_t real_start, int64_t start) {
+    std::lock_guard<std::mutex> lg(mtx);
+    spans.push_back(TraceSpan{trace_id, offset, real_start, current_usec() - start, name});
+}
+
+coke::Task<> FileSender::fetch_spans() {
+    std::size_t ntarget = file_tokens.size();
+
+    target_spans.assign(ntarget, {});
+
+    for (std::size_t i = 0; i < ntarget; i++) {
+        GetTraceReq req;
+        GetTraceResp resp;
+        int ret;
+
+        req.file_token = file_tokens[i];
+        ret = co_await control().request(params.targets[i], std::move(req), resp);
+        if (ret == 0)
+            ret = resp.get_error();
+
+        // tracing never fails a transfer
+        if (ret == 0)
+            target_spans[i] = std::move(resp.spans);
+    }
+}
+
+void FileSender::init_chunk_order() {
+    std::size_t chunk_size = params.chunk_size;
+    std::size_t nchunk = (file_size + chunk_size - 1) / chunk_size;
+    std::vector<FileExtent> extents;
+    std::vector<std::pair<uint64_t, std::size_t>> keys;
+    std::size_t j = 0;
+
+    chunk_order.clear();
+
+    if (nchunk < 2 || get_file_extents(fd, 0, 0, extents) != 0 || extents.size() < 2)
+        return;
+
+    // a chunk in a hole or unknown extent keeps the place after its
+    // previous chunk
+    uint64_t key = 0;
+    keys.reserve(nchunk);
+
+    for (std::size_t i = 0; i < nchunk; i++) {
+        uint64_t offset = (uint64_t)i * chunk_size;
+
+        while (j < extents.size() && extents[j].logical + extents[j].length <= offset)
+            j++;
+
+        if (j < extents.size() && extents[j].logical <= offset && extents[j].physical != 0)
+            key = extents[j].physical + (offset - extents[j].logical);
+
+        keys.emplace_back(key, i);
+    }
+
+    std::stable_sort(keys.begin(), keys.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+
+    bool sorted = true;
+    for (std::size_t i = 0; i < nchunk && sorted; i++)
+        sorted = (keys[i].second == i);
+
+    if (sorted)
+        return;
+
+    chunk_order.reserve(nchunk);
+    for (const auto &k : keys)
+        chunk_order.push_back(k.second * chunk_size);
+}
+
+bool FileSender::next_chunk(std::size_t chunk_size, std::size_t &offset) {
+    std::lock_guard<std::mutex> lg(mtx);
+    if (cur_offset >= file_size)
+        return false;
+
+    if (chunk_order.empty())
+        offset = cur_offset;
+    else
+        offset = chunk_order[cur_offset / params.chunk_size];
+
+    cur_offset += chunk_size;
+    return true;
+}
+
+coke::Task<> FileSender::parallel_send(int index, RemoteTarget target, std::string token) {
     std::size_t chunk_size = params.chunk_size;
+    std::size_t buf_size = 0;
     std::size_t local_offset;
     coke::FileResult result;
     int local_error = 0;
-
-    void *buf = std::aligned_alloc(FCOPY_CHUNK_BASE, chunk_size);
-    if (buf == nullptr) {
-        error = errno;
-        co_return;
-    }
+    void *buf = nullptr;
+    const char *chunk;
+    std::shared_ptr<char> synthetic_buf;
+    uint64_t trace_id = 0;
+    int64_t start, real_start;
 
     while (error == 0) {
-        {
-            std::lock_guard<std::mutex> lg(mtx);
-            if (cur_offset < file_size) {
-                local_offset = cur_offset;
-                cur_offset += chunk_size;
+        if (controller) {
+            // this worker is not needed now, wait until the controller grows
+            if (index >= controller->get_parallel()) {
+                if (is_all_claimed())
+                    break;
+
+                co_await coke::sleep(std::chrono::milliseconds(10));
+                continue;
             }
-            else
+
+            // chunks in physical order are claimed by index of a fixed size
+            if (chunk_order.empty())
+                chunk_size = controller->get_chunk_size();
+        }
+
+        if (params.synthetic_size > 0) {
+            // generated data at memory speed, nothing is read or copied
+            if (!next_chunk(chunk_size, local_offset))
                 break;
+
+            synthetic_buf = get_synthetic(chunk_size);
+            if (!synthetic_buf) {
+                local_error = ENOMEM;
+                break;
+            }
+
+            trace_id = next_trace_id();
+            result.state = coke::STATE_SUCCESS;
+            result.error = 0;
+            result.nbytes = std::min(chunk_size, file_size - local_offset);
+            chunk = synthetic_buf.get() + local_offset % SYNTHETIC_PERIOD;
         }
+        else if (map) {
+            // send from the mapped file without copying
+            if (!next_chunk(chunk_size, local_offset))
+                break;
 
-        result = co_await coke::pread(fd, buf, chunk_size, local_offset);
-        if (result.state != coke::STATE_SUCCESS) {
-            local_error = result.error;
-            break;
+            trace_id = next_trace_id();
+            real_start = trace_id ? realtime_usec() : 0;
+            start = current_usec();
+
+            result.state = coke::STATE_SUCCESS;
+            result.error = 0;
+            result.nbytes = std::min(chunk_size, file_size - local_offset);
+            chunk = map + local_offset;
+
+            co_await coke::switch_go_thread();
+            prefault(chunk, result.nbytes);
+
+            if (trace_id)
+                add_span(trace_id, local_offset, "read", real_start, start);
+        }
+        else {
+            if (buf_size < chunk_size) {
+                std::free(buf);
+                buf_size = chunk_size;
+                buf = std::aligned_alloc(FCOPY_CHUNK_BASE, buf_size);
+
+                if (buf == nullptr) {
+                    local_error = errno;
+                    break;
+                }
+            }
+
+            if (!next_chunk(chunk_size, local_offset))
+                break;
+
+            trace_id = next_trace_id();
+            real_start = trace_id ? realtime_usec() : 0;
+            start = current_usec();
+
+            result = co_await coke::pread(fd, buf, chunk_size, local_offset);
+            if (result.state != coke::STATE_SUCCESS) {
+                local_error = result.error;
+                break;
+            }
+
+            if (trace_id)
+                add_span(trace_id, local_offset, "read", real_start, start);
+
+            chunk = static_cast<const char *>(buf);
         }
 
-        if (speed_limiter && result.nbytes > 0) {
-            constexpr long MB = 1024 * 1024;
-            co_await speed_limiter->get(result.nbytes / MB);
+        if (speed_limiter && speed_limiter->is_limited() && result.nbytes > 0) {
+            real_start = trace_id ? realtime_usec() : 0;
+            start = current_usec();
+
+            co_await speed_limiter->get(target.host, target.port, result.nbytes);
+
+            if (trace_id)
+                add_span(trace_id, local_offset, "limiter", real_start, start);
         }
 
-        SendFileReq req;
-        SendFileResp resp;
+        for (int busy_retry = 0; ; busy_retry++) {
+            SendFileReq req;
+            FcopyRequest freq;
+
+            real_start = trace_id ? realtime_usec() : 0;
+            start = current_usec();
+
+            req.max_chain_len = static_cast<uint16_t>(params.targets.size());
+            req.compress_type = 0;
+            req.origin_size = result.nbytes;
+            req.crc32 = 0;
+            req.offset = local_offset;
+            req.file_token = token;
+            req.trace_id = trace_id;
+            req.set_content_view(chunk, result.nbytes);
+            freq.set_message(std::move(req));
+
+            // await the network task directly, without a coroutine frame of
+            // the message level request per chunk
+            if (progress)
+                progress->inflight_bytes.fetch_add(result.nbytes, std::memory_order_relaxed);
+
+            auto res = co_await cli.request(target, std::move(freq), (unsigned)index);
+            if (res.state != coke::STATE_SUCCESS)
+                local_error = res.error;
+            else
+                local_error = res.resp.get_error();
+
+            if (local_error == 0)
+                acked_chunks.fetch_add(1, std::memory_order_relaxed);
+            else if (local_error == ERR_SERVER_BUSY)
+                retries.fetch_add(1, std::memory_order_relaxed);
+
+            if (progress) {
+                progress->inflight_bytes.fetch_sub(result.nbytes, std::memory_order_relaxed);
+
+                if (local_error == 0) {
+                    progress->acked_bytes.fetch_add(result.nbytes, std::memory_order_relaxed);
+                    progress->chunk_latency.record(current_usec() - start);
+                }
+                else if (local_error == ERR_SERVER_BUSY)
+                    progress->retries.fetch_add(1, std::memory_order_relaxed);
+            }
 
-        req.max_chain_len = static_cast<uint16_t>(params.targets.size());
-        req.compress_type = 0;
-        req.origin_size = result.nbytes;
-        req.crc32 = 0;
-        req.offset = local_offset;
-        req.file_token = token;
-        req.set_content_view(static_cast<const char *>(buf), result.nbytes);
+            if (trace_id)
+                add_span(trace_id, local_offset, "request", real_start, start);
+
+            if (controller) {
+                if (local_error == 0)
+                    controller->on_chunk_done(result.nbytes, current_usec() - start);
+                else if (local_error == ERR_SERVER_BUSY)
+                    controller->on_server_busy();
+            }
+
+            // some server in the chain is out of memory budget, retry later
+            if (local_error != ERR_SERVER_BUSY || busy_retry >= params.busy_retry_max)
+                break;
+
+            int ms = std::min(10 << std::min(busy_retry, 7), 1000);
+            co_await coke::sleep(std::chrono::milliseconds(ms));
+        }
 
-        local_error = co_await cli.request(target, std::move(req), resp);
-        if (local_error == 0)
-            local_error = resp.get_error();
         if (local_error != 0)
             break;
     }
@@ -147,10 +449,13 @@ coke::Task<int> FileSender::remote_open() {
 
     file_tokens.clear();
     file_tokens.reserve(ntarget);
+    open_cost.assign(ntarget, -1);
+    close_cost.assign(ntarget, -1);
 
     for (std::size_t i = 0; i < ntarget; i++) {
         CreateFileReq req;
         CreateFileResp resp;
+        int64_t start = current_usec();
         req.chunk_size = params.chunk_size;
         // TODO req.file_perm = finfo.file_perm;
         req.file_perm = 0;
@@ -158,16 +463,23 @@ coke::Task<int> FileSender::remote_open() {
         req.partition = params.partition;
         req.relative_path = params.remote_file_dir;
         req.file_name = params.remote_file_name;
+        req.atomic = params.atomic ? 1 : 0;
+        req.commit_dir = params.commit_dir;
+        req.sched_class = params.sched_class;
 
         RemoteTarget &rtarget = params.targets[i];
-        local_error = co_await cli.request(rtarget, std::move(req), resp);
+        local_error = co_await control().request(rtarget, std::move(req), resp);
         if (local_error == 0)
             local_error = resp.get_error();
 
+        open_cost[i] = current_usec() - start;
         if (local_error != 0)
             break;
 
         file_tokens.push_back(resp.file_token);
+
+        if (controller && resp.max_chunk_size != 0)
+            controller->set_max_chunk_size(resp.max_chunk_size);
     }
 
     co_return local_error;
@@ -186,13 +498,17 @@ coke::Task<int> FileSender::remote_close() {
         RemoteTarget &rtarget = params.targets[i];
         CloseFileReq req;
         CloseFileResp resp;
+        int64_t start = current_usec();
 
         req.wait_close = wait;
         req.file_token = file_tokens[i];
-        local_error = co_await cli.request(rtarget, std::move(req), resp);
+        local_error = co_await control().request(rtarget, std::move(req), resp);
         if (local_error == 0)
             local_error = resp.get_error();
 
+        if (i < close_cost.size())
+            close_cost[i] = current_usec() - start;
+
         if (local_error && first_error == 0)
             first_error = local_error;
 
@@ -206,64 +522,73 @@ coke::Task<int> FileSender::remote_close() {
     co_return first_error;
 }
 
-coke::Task<int> FileSender::set_send_chain() {
+coke::Task<int> FileSender::remote_delete() {
     std::size_t ntarget = file_tokens.size();
+    int first_error = 0;
     int local_error = 0;
 
-    for (std::size_t i = 0; i + 1 < ntarget; i++) {
-        SetChainReq req;
-        SetChainResp resp;
-        ChainTarget chain_target;
+    for (std::size_t i = 0; i < ntarget; i++) {
+        if (file_tokens[i].empty())
+            continue;
 
-        chain_target.file_token = file_tokens[i+1];
-        chain_target.host = params.targets[i+1].host;
-        chain_target.port = params.targets[i+1].port;
+        RemoteTarget &rtarget = params.targets[i];
+        DeleteFileReq req;
+        DeleteFileResp resp;
 
         req.file_token = file_tokens[i];
-        req.targets.push_back(chain_target);
-
-        RemoteTarget &rtarget = params.targets[i];
-        local_error = co_await cli.request(rtarget, std::move(req), resp);
+        local_error = co_await control().request(rtarget, std::move(req), resp);
         if (local_error == 0)
             local_error = resp.get_error();
 
-        if (local_error != 0)
-            break;
+        if (local_error && first_error == 0)
+            first_error = local_error;
     }
 
-    co_return local_error;
+    file_tokens.clear();
+    co_return first_error;
 }
 
-coke::Task<int> FileSender::set_send_tree() {
-    std::size_t ntarget = file_tokens.size();
+std::vector<std::vector<std::size_t>> send_layout(int send_method, std::size_t ntarget) {
+    std::vector<std::vector<std::size_t>> layout(ntarget);
+
+    for (std::size_t i = 0; i < ntarget; i++) {
+        if (send_method == SEND_METHOD_TREE) {
+            for (std::size_t j = i*2+1; j <= i*2+2 && j < ntarget; j++)
+                layout[i].push_back(j);
+        }
+        else if (i + 1 < ntarget)
+            layout[i].push_back(i + 1);
+    }
+
+    return layout;
+}
+
+coke::Task<int> FileSender::set_send_layout() {
+    auto layout = send_layout(params.send_method, file_tokens.size());
     int local_error = 0;
 
-    for (std::size_t i = 0; i*2+1 < ntarget; i++) {
+    for (std::size_t i = 0; i < layout.size(); i++) {
         SetChainReq req;
         SetChainResp resp;
-        {
-            ChainTarget chain_target;
-            chain_target.file_token = file_tokens[i*2+1];
-            chain_target.host = params.targets[i*2+1].host;
-            chain_target.port = params.targets[i*2+1].port;
-            req.targets.push_back(chain_target);
-        }
 
-        if (i*2+2 < ntarget) {
+        if (layout[i].empty())
+            continue;
+
+        for (std::size_t j : layout[i]) {
             ChainTarget chain_target;
-            chain_target.file_token = file_tokens[i*2+2];
-            chain_target.host = params.targets[i*2+2].host;
-            chain_target.port = params.targets[i*2+2].port;
+            chain_target.file_token = file_tokens[j];
+            chain_target.host = params.targets[j].host;
+            chain_target.port = params.targets[j].port;
             req.targets.push_back(chain_target);
         }
 
         req.file_token = file_tokens[i];
 
         RemoteTarget &rtarget = params.targets[i];
-        local_error = co_await cli.request(rtarget, std::move(req), resp);
-
+        local_error = co_await control().request(rtarget, std::move(req), resp);
         if (local_error == 0)
             local_error = resp.get_error();
+
         if (local_error != 0)
             break;
     }
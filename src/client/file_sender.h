@@ -6,15 +6,22 @@
 #include <mutex>
 #include <filesystem>
 #include <atomic>
+#include <memory>
 
-#include "coke/qps_pool.h"
 #include "common/co_fcopy.h"
+#include "common/rate_limiter.h"
+#include "client/adaptive_controller.h"
+#include "client/transfer_report.h"
 
 enum {
     SEND_METHOD_CHAIN = 0,
     SEND_METHOD_TREE = 1,
 };
 
+// next targets of each target in `send_method`, chunks sent to target 0
+// reach all `ntarget` targets
+std::vector<std::vector<std::size_t>> send_layout(int send_method, std::size_t ntarget);
+
 struct SenderParams {
     using perms = std::filesystem::perms;
 
@@ -29,16 +36,45 @@ struct SenderParams {
     std::string password;
 
     std::string partition;
+    std::string sched_class;
     std::string remote_file_dir;
     std::string remote_file_name;
 
     bool direct_io          = true;
     bool wait_close         = true;
+
+    // without direct_io, map the file and send chunks from the page cache
+    // instead of reading them into a buffer, the file must not be truncated
+    // during sending
+    bool zero_copy          = false;
+
+    // send generated data of this size instead of reading file_path, the
+    // data depends only on the offset, so any receiver can verify it
+    std::size_t synthetic_size = 0;
+
+    // read chunks in order of their location on disk instead of their offset,
+    // for fragmented files on rotational disks, chunk size is then fixed
+    bool physical_order     = false;
+
+    // publish remote file when closed, or with the whole commit_dir
+    bool atomic             = false;
+    std::string commit_dir;
+
+    // with adaptive controller, parallel is the max number of chunks in flight
     int parallel            = 16;
+
+    // times to resend a chunk rejected by a busy server
+    int busy_retry_max      = 100;
     int send_method         = SEND_METHOD_CHAIN;
     std::vector<RemoteTarget> targets;
+
+    // trace one of every trace_sample chunks, 0 means no tracing
+    int trace_sample        = 0;
 };
 
+// the synthetic pattern repeats every SYNTHETIC_PERIOD bytes
+constexpr std::size_t SYNTHETIC_PERIOD = 1024UL * 1024;
+
 class FileSender {
 public:
     FileSender(FcopyClient &cli, const SenderParams &params)
@@ -47,40 +83,110 @@ public:
 
     coke::Task<int> create_file();
     coke::Task<int> close_file();
+
+    // discard the remote files instead of closing them after a failed send
+    coke::Task<int> delete_file();
     coke::Task<int> send_file();
 
-    void set_speed_limiter(coke::QpsPool *limiter) {
+    void set_speed_limiter(LinkRateLimiter *limiter) {
         speed_limiter = limiter;
     }
 
+    // tune parallel and chunk size during transfer
+    void set_controller(AdaptiveController *controller) {
+        this->controller = controller;
+    }
+
+    // send create, set chain and close requests by another client, so they
+    // do not wait for connections busy with chunks
+    void set_control_client(FcopyClient *ctrl_cli) {
+        this->ctrl_cli = ctrl_cli;
+    }
+
+    // account acked bytes, in flight bytes and chunk latency of this file to
+    // the progress shared by all files
+    void set_progress(TransferProgress *progress) {
+        this->progress = progress;
+    }
+
     int get_error() const { return error; }
 
     // get info after send
     std::size_t get_cost_us() const { return send_cost; }
     std::size_t get_file_size() const { return file_size; }
     std::size_t get_cur_offset() const { return cur_offset; }
+    uint64_t get_acked_chunks() const { return acked_chunks; }
+    uint64_t get_retries() const { return retries; }
+
+    // cost of create and close requests of each target, -1 if not sent
+    const std::vector<int64_t> &get_open_cost() const { return open_cost; }
+    const std::vector<int64_t> &get_close_cost() const { return close_cost; }
+
+    // spans of sampled chunks, on this client and on each target, the latter
+    // are fetched before the remote files are closed
+    const std::vector<TraceSpan> &get_spans() const { return spans; }
+    const std::vector<std::vector<TraceSpan>> &get_target_spans() const {
+        return target_spans;
+    }
 
 private:
     coke::Task<int> remote_open();
     coke::Task<int> remote_close();
-    coke::Task<int> set_send_chain();
-    coke::Task<int> set_send_tree();
-    coke::Task<> parallel_send(RemoteTarget target, std::string token);
+    coke::Task<int> remote_delete();
+    coke::Task<int> set_send_layout();
+    coke::Task<> parallel_send(int index, RemoteTarget target, std::string token);
+    coke::Task<> fetch_spans();
+
+    // a buffer of the synthetic pattern, long enough for a chunk of `size`
+    // from any offset
+    std::shared_ptr<char> get_synthetic(std::size_t size);
+
+    uint64_t next_trace_id();
+    void add_span(uint64_t trace_id, uint64_t offset, const char *name,
+                  int64_t real_start, int64_t start);
+
+    FcopyClient &control() { return ctrl_cli ? *ctrl_cli : cli; }
+
+    void close_local();
+    void init_chunk_order();
+    bool next_chunk(std::size_t chunk_size, std::size_t &offset);
+    bool is_all_claimed() {
+        std::lock_guard<std::mutex> lg(mtx);
+        return cur_offset >= file_size;
+    }
 
 private:
     FcopyClient &cli;
+    FcopyClient *ctrl_cli{nullptr};
     SenderParams params;
-    coke::QpsPool *speed_limiter{nullptr};
+    LinkRateLimiter *speed_limiter{nullptr};
+    AdaptiveController *controller{nullptr};
+    TransferProgress *progress{nullptr};
 
     std::mutex mtx;
     std::atomic<int> error{0};
     int fd = -1;
+    char *map = nullptr;
 
     std::size_t file_size = 0;
     std::size_t cur_offset = 0;
     std::size_t send_cost = 0;
 
+    // offsets of chunks sorted by physical address, empty means in order
+    std::vector<std::size_t> chunk_order;
+
     std::vector<std::string> file_tokens;
+    std::shared_ptr<char> synthetic;
+    std::size_t synthetic_len = 0;
+    std::vector<int64_t> open_cost;
+    std::vector<int64_t> close_cost;
+
+    std::atomic<uint64_t> acked_chunks{0};
+    std::atomic<uint64_t> retries{0};
+
+    std::atomic<uint64_t> chunk_seq{0};
+    std::vector<TraceSpan> spans;
+    std::vector<std::vector<TraceSpan>> target_spans;
 };
 
 #endif // FCOPY_FILE_SENDER_H
@@ -0,0 +1,139 @@
+#include "client/transfer_report.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <chrono>
+
+#include "common/utils.h"
+#include "common/fcopy_log.h"
+
+static std::string target_name(const RemoteTarget &t) {
+    return t.host + ":" + std::to_string(t.port);
+}
+
+int TransferReport::write(const std::string &path, const std::vector<RemoteTarget> &targets,
+                          const TransferProgress &progress, int64_t cost_us) const {
+    std::vector<uint64_t> counts(Histogram::BUCKETS);
+    uint64_t sum, count = 0;
+    uint64_t acked = progress.acked_bytes;
+    int first_error = 0;
+    FILE *fp;
+
+    progress.chunk_latency.snapshot(counts.data(), sum);
+    for (uint64_t c : counts)
+        count += c;
+
+    for (const FileReport &f : files) {
+        if (f.error != 0) {
+            first_error = f.error;
+            break;
+        }
+    }
+
+    fp = fopen(path.c_str(), "w");
+    if (!fp)
+        return errno;
+
+    fprintf(fp, "{\n  \"targets\": [");
+    for (std::size_t i = 0; i < targets.size(); i++)
+        fprintf(fp, "%s%s", i ? ", " : "", json_quote(target_name(targets[i])).c_str());
+    fprintf(fp, "],\n");
+
+    fprintf(fp, "  \"total_bytes\": %llu,\n  \"acked_bytes\": %llu,\n",
+            (unsigned long long)progress.total_bytes.load(), (unsigned long long)acked);
+    fprintf(fp, "  \"cost_us\": %lld,\n  \"bytes_per_second\": %.0lf,\n",
+            (long long)cost_us, cost_us > 0 ? acked * 1.0e6 / cost_us : 0.0);
+    fprintf(fp, "  \"retries\": %llu,\n  \"error\": %d,\n",
+            (unsigned long long)progress.retries.load(), first_error);
+
+    fprintf(fp, "  \"chunk_latency_us\": {\"count\": %llu, \"mean\": %.0lf, "
+            "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu},\n",
+            (unsigned long long)count, count ? (double)sum / count : 0.0,
+            (unsigned long long)Histogram::quantile(counts.data(), 0.5),
+            (unsigned long long)Histogram::quantile(counts.data(), 0.9),
+            (unsigned long long)Histogram::quantile(counts.data(), 0.99),
+            (unsigned long long)Histogram::quantile(counts.data(), 1.0));
+
+    fprintf(fp, "  \"files\": [");
+    for (std::size_t i = 0; i < files.size(); i++) {
+        const FileReport &f = files[i];
+
+        fprintf(fp, "%s\n    {\"path\": %s, \"size\": %llu, \"error\": %d, "
+                "\"create_us\": %lld, \"send_us\": %lld, \"close_us\": %lld, "
+                "\"chunks\": %llu, \"retries\": %llu, \"targets\": [",
+                i ? "," : "", json_quote(f.path).c_str(), (unsigned long long)f.size,
+                f.error, (long long)f.create_us, (long long)f.send_us,
+                (long long)f.close_us, (unsigned long long)f.chunks,
+                (unsigned long long)f.retries);
+
+        for (std::size_t j = 0; j < targets.size(); j++) {
+            int64_t open_us = j < f.target_open_us.size() ? f.target_open_us[j] : -1;
+            int64_t close_us = j < f.target_close_us.size() ? f.target_close_us[j] : -1;
+
+            fprintf(fp, "%s{\"target\": %s, \"open_us\": %lld, \"close_us\": %lld}",
+                    j ? ", " : "", json_quote(target_name(targets[j])).c_str(),
+                    (long long)open_us, (long long)close_us);
+        }
+
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+
+    if (fclose(fp) != 0)
+        return errno;
+
+    return 0;
+}
+
+void ProgressPrinter::start(int interval_ms) {
+    stopped = false;
+    th = std::thread(&ProgressPrinter::run, this, interval_ms);
+}
+
+void ProgressPrinter::stop() {
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        stopped = true;
+    }
+
+    cv.notify_all();
+    if (th.joinable())
+        th.join();
+}
+
+void ProgressPrinter::run(int interval_ms) {
+    std::unique_lock<std::mutex> lk(mtx);
+    int64_t last_usec = current_usec();
+    uint64_t last_bytes = 0;
+
+    while (!cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+                        [this] { return stopped; }))
+    {
+        print(last_usec, last_bytes);
+    }
+}
+
+void ProgressPrinter::print(int64_t &last_usec, uint64_t &last_bytes) {
+    int64_t now = current_usec();
+    uint64_t total = progress.total_bytes;
+    uint64_t acked = progress.acked_bytes;
+    uint64_t bytes = acked - last_bytes;
+    int64_t usec = now - last_usec;
+    double eta = -1;
+
+    if (bytes > 0 && total > acked)
+        eta = (total - acked) * (double)usec / bytes / 1.0e6;
+    else if (total <= acked)
+        eta = 0;
+
+    std::string rate = format_bps(bytes, usec);
+    FLOG_INFO("Progress files:%d/%d acked:%llu/%llu rate:%s inflight:%llu retries:%llu eta:%.0lf",
+        progress.files_done.load(), progress.total_files.load(),
+        (unsigned long long)acked, (unsigned long long)total, rate.c_str(),
+        (unsigned long long)progress.inflight_bytes.load(),
+        (unsigned long long)progress.retries.load(), eta
+    );
+
+    last_usec = now;
+    last_bytes = acked;
+}
@@ -0,0 +1,83 @@
+#ifndef FCOPY_TRANSFER_REPORT_H
+#define FCOPY_TRANSFER_REPORT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/co_fcopy.h"
+#include "common/metrics.h"
+
+// TransferProgress is shared by the senders of all files, they update it with
+// relaxed atomics and readers sample it at any time.
+struct TransferProgress {
+    std::atomic<uint64_t> total_bytes{0};
+    std::atomic<uint64_t> acked_bytes{0};
+    std::atomic<uint64_t> inflight_bytes{0};
+    std::atomic<uint64_t> retries{0};
+    std::atomic<int> files_done{0};
+    std::atomic<int> total_files{0};
+
+    // from sending a chunk to its ack, which covers all targets in chain
+    Histogram chunk_latency;
+};
+
+struct FileReport {
+    std::string path;
+    uint64_t size = 0;
+    int error = 0;
+
+    int64_t create_us = 0;
+    int64_t send_us = 0;
+    int64_t close_us = 0;
+    uint64_t chunks = 0;
+    uint64_t retries = 0;
+
+    // cost of create and close requests of each target
+    std::vector<int64_t> target_open_us;
+    std::vector<int64_t> target_close_us;
+};
+
+// TransferReport writes per file and per target timings, and the chunk latency
+// distribution, as a json document for orchestration systems.
+class TransferReport {
+public:
+    void add_file(FileReport report) { files.push_back(std::move(report)); }
+
+    // return 0 or errno
+    int write(const std::string &path, const std::vector<RemoteTarget> &targets,
+              const TransferProgress &progress, int64_t cost_us) const;
+
+private:
+    std::vector<FileReport> files;
+};
+
+// ProgressPrinter logs bytes acked, rate and eta every interval in a thread of
+// its own, the senders are not touched.
+class ProgressPrinter {
+public:
+    ProgressPrinter(const TransferProgress &progress) : progress(progress) { }
+    ProgressPrinter(const ProgressPrinter &) = delete;
+    ~ProgressPrinter() { stop(); }
+
+    void start(int interval_ms);
+    void stop();
+
+private:
+    void run(int interval_ms);
+    void print(int64_t &last_usec, uint64_t &last_bytes);
+
+private:
+    const TransferProgress &progress;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopped{false};
+    std::thread th;
+};
+
+#endif // FCOPY_TRANSFER_REPORT_H
@@ -0,0 +1,93 @@
+#include "common/chunk_pool.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+#include "common/message.h"
+
+static std::mutex pool_mtx;
+static std::unordered_map<std::size_t, std::vector<void *>> pool;
+static std::size_t pool_limit = 0;
+static std::size_t pool_idle = 0;
+
+// round up to make buffers of near sizes reusable, e.g. the last chunk of
+// files, or chunks of an adaptive client
+static std::size_t round_size(std::size_t size) {
+    constexpr std::size_t MB = 1024 * 1024;
+    std::size_t unit = size >= MB ? MB : FCOPY_CHUNK_BASE;
+
+    return (size + unit - 1) / unit * unit;
+}
+
+// free idle buffers until `size` more bytes fit in the pool, pool_mtx is held
+static void shrink_to_fit(std::size_t size) {
+    auto it = pool.begin();
+
+    while (pool_idle + size > pool_limit && it != pool.end()) {
+        std::vector<void *> &bufs = it->second;
+
+        while (!bufs.empty() && pool_idle + size > pool_limit) {
+            std::free(bufs.back());
+            bufs.pop_back();
+            pool_idle -= it->first;
+        }
+
+        if (bufs.empty())
+            it = pool.erase(it);
+        else
+            ++it;
+    }
+}
+
+void fcopy_set_chunk_pool_size(std::size_t size) {
+    std::lock_guard<std::mutex> lg(pool_mtx);
+
+    pool_limit = size;
+    shrink_to_fit(0);
+}
+
+std::size_t fcopy_get_chunk_pool_idle() {
+    std::lock_guard<std::mutex> lg(pool_mtx);
+    return pool_idle;
+}
+
+void *fcopy_chunk_alloc(std::size_t size) {
+    size = round_size(size);
+
+    {
+        std::lock_guard<std::mutex> lg(pool_mtx);
+        auto it = pool.find(size);
+
+        if (it != pool.end() && !it->second.empty()) {
+            void *p = it->second.back();
+            it->second.pop_back();
+            pool_idle -= size;
+            return p;
+        }
+    }
+
+    return std::aligned_alloc(FCOPY_CHUNK_BASE, size);
+}
+
+void fcopy_chunk_free(void *p, std::size_t size) {
+    if (!p)
+        return;
+
+    size = round_size(size);
+
+    {
+        std::lock_guard<std::mutex> lg(pool_mtx);
+
+        if (size <= pool_limit) {
+            // prefer keeping buffers of the size in use now
+            shrink_to_fit(size);
+            pool[size].push_back(p);
+            pool_idle += size;
+            return;
+        }
+    }
+
+    std::free(p);
+}
@@ -0,0 +1,17 @@
+#ifndef FCOPY_CHUNK_POOL_H
+#define FCOPY_CHUNK_POOL_H
+
+#include <cstddef>
+
+// Process wide pool of freed chunk buffers. A reused buffer is already
+// faulted in, so receiving and forwarding a chunk does not pay for page
+// faults, zeroing and unmapping of a fresh multi-MB buffer. Pool size 0
+// means buffers are not kept.
+void fcopy_set_chunk_pool_size(std::size_t size);
+std::size_t fcopy_get_chunk_pool_idle();
+
+// buffers are aligned to FCOPY_CHUNK_BASE, and must be freed with the same size
+void *fcopy_chunk_alloc(std::size_t size);
+void fcopy_chunk_free(void *p, std::size_t size);
+
+#endif // FCOPY_CHUNK_POOL_H
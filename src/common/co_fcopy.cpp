@@ -1,14 +1,80 @@
 #include "common/co_fcopy.h"
 
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
 #include "workflow/WFTaskFactory.h"
+#include "common/utils.h"
 
 using fcopy_callback_t = std::function<void (FcopyTask *)>;
+using ComplexType = WFComplexClientTask<FcopyRequest, FcopyResponse>;
+
+// re-resolve hosts after this time, in case the address is changed
+constexpr int64_t TARGET_ADDR_TTL = 600LL * 1000 * 1000;
+
+struct CachedAddr {
+    int64_t expire_usec;
+    std::shared_ptr<const TargetAddr> addr;
+};
+
+static std::mutex addr_mtx;
+static std::unordered_map<std::string, CachedAddr> addr_cache;
+
+bool resolve_target(RemoteTarget &target) {
+    std::string key = target.host + ":" + std::to_string(target.port);
+    std::string port = std::to_string(target.port);
+    int64_t now = current_usec();
+
+    {
+        std::lock_guard<std::mutex> lg(addr_mtx);
+        auto it = addr_cache.find(key);
+        if (it != addr_cache.end()) {
+            if (it->second.expire_usec > now) {
+                target.addr = it->second.addr;
+                return true;
+            }
+
+            addr_cache.erase(it);
+        }
+    }
+
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    if (getaddrinfo(target.host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+        return false;
+
+    auto addr = std::make_shared<TargetAddr>();
+    memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
+    addr->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    std::lock_guard<std::mutex> lg(addr_mtx);
+
+    // drop hosts that are not looked up any more
+    for (auto it = addr_cache.begin(); it != addr_cache.end(); ) {
+        if (it->second.expire_usec <= now)
+            it = addr_cache.erase(it);
+        else
+            ++it;
+    }
 
-FcopyTask *create_fcopy_task(const std::string &host, unsigned short port,
+    addr_cache[key] = CachedAddr{now + TARGET_ADDR_TTL, addr};
+    target.addr = std::move(addr);
+    return true;
+}
+
+ComplexType *create_fcopy_task(const std::string &host, unsigned short port,
                              bool use_ssl, int retry_max, fcopy_callback_t callback)
 {
-    using ComplexType = WFComplexClientTask<FcopyRequest, FcopyResponse>;
-
     std::string url("fcopy://");
     ParsedURI uri;
 
@@ -22,9 +88,54 @@ FcopyTask *create_fcopy_task(const std::string &host, unsigned short port,
     return task;
 }
 
+// the connection pool is chosen by info when the task is initialized
+ComplexType *create_fcopy_task(const TargetAddr &addr, const std::string &info,
+                             bool use_ssl, int retry_max, fcopy_callback_t callback)
+{
+    const struct sockaddr *sa = (const struct sockaddr *)&addr.addr;
+    auto *task = new ComplexType(retry_max, std::move(callback));
+
+    task->init(use_ssl ? TT_TCP_SSL : TT_TCP, sa, addr.addrlen, info);
+    return task;
+}
+
 FcopyClient::AwaiterType
 FcopyClient::request(const std::string &host, unsigned short port, ReqType &&req) noexcept {
-    FcopyTask *task = create_fcopy_task(host, port, false, params.retry_max, nullptr);
+    ComplexType *task = create_fcopy_task(host, port, false, params.retry_max, nullptr);
+
+    if (!params.lane.empty())
+        task->set_info(params.lane);
+
+    *(task->get_req()) = std::move(req);
+
+    task->set_send_timeout(params.send_timeout);
+    task->set_receive_timeout(params.receive_timeout);
+    task->set_keep_alive(params.keep_alive_timeout);
+
+    return AwaiterType(task);
+}
+
+FcopyClient::AwaiterType
+FcopyClient::request(const RemoteTarget &target, ReqType &&req,
+                     unsigned stream_key) noexcept {
+    ComplexType *task;
+    std::string info;
+
+    // workflow keeps a separate connection pool for each info
+    if (params.streams > 1) {
+        unsigned stream = stream_key % (unsigned)params.streams;
+        info = params.lane + "stream-" + std::to_string(stream);
+    }
+    else
+        info = params.lane;
+
+    if (target.addr)
+        task = create_fcopy_task(*target.addr, info, false, params.retry_max, nullptr);
+    else {
+        task = create_fcopy_task(target.host, target.port, false, params.retry_max, nullptr);
+        if (!info.empty())
+            task->set_info(info);
+    }
 
     *(task->get_req()) = std::move(req);
 
@@ -34,3 +145,55 @@ FcopyClient::request(const std::string &host, unsigned short port, ReqType &&req
 
     return AwaiterType(task);
 }
+
+int set_socket_params(int fd, const SocketParams &params) {
+    int val;
+
+    if (params.reuse_port) {
+        val = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) != 0)
+            return errno;
+    }
+
+    if (params.send_buffer > 0) {
+        val = params.send_buffer;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)) != 0)
+            return errno;
+    }
+
+    if (params.recv_buffer > 0) {
+        val = params.recv_buffer;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) != 0)
+            return errno;
+    }
+
+    if (params.notsent_lowat > 0) {
+        val = params.notsent_lowat;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof(val)) != 0)
+            return errno;
+    }
+
+    if (!params.congestion.empty()) {
+        const std::string &cc = params.congestion;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cc.c_str(), cc.size()) != 0)
+            return errno;
+    }
+
+    return 0;
+}
+
+int FcopyServer::create_listen_fd() {
+    int fd = FcopyServerBase::create_listen_fd();
+    int error;
+
+    if (fd >= 0) {
+        error = set_socket_params(fd, sock_params);
+        if (error) {
+            close(fd);
+            errno = error;
+            return -1;
+        }
+    }
+
+    return fd;
+}
@@ -1,6 +1,10 @@
 #ifndef FCOPY_TASK_H
 #define FCOPY_TASK_H
 
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+
 #include "common/message.h"
 #include "coke/global.h"
 #include "coke/net/basic_server.h"
@@ -10,13 +14,50 @@ struct FcopyClientParams {
     int send_timeout        = -1;
     int receive_timeout     = -1;
     int keep_alive_timeout  = 60 * 1000;
+
+    // connections to each target are split into this many streams, requests
+    // with the same stream key always use connections of the same stream
+    int streams             = 1;
+
+    // clients of different lanes never share connections, e.g. small control
+    // messages do not queue behind bulk data
+    std::string lane;
+};
+
+// tcp options of a socket, zero or empty keeps the system default. Only
+// listening sockets are tuned, workflow creates connecting sockets itself
+struct SocketParams {
+    int send_buffer         = 0;
+    int recv_buffer         = 0;
+    int notsent_lowat       = 0;
+    std::string congestion; // e.g. bbr, cubic
+
+    // let several listening sockets bind the same port, the kernel spreads
+    // new connections over them
+    bool reuse_port         = false;
+};
+
+// return 0 on success, or errno of the first failed option
+int set_socket_params(int fd, const SocketParams &params);
+
+struct TargetAddr {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
 };
 
 struct RemoteTarget {
     std::string host;
     unsigned short port;
+
+    // resolved address shared by copies, see resolve_target
+    std::shared_ptr<const TargetAddr> addr;
 };
 
+// Resolve host:port once, addresses are cached process wide for a while. If
+// failed, requests to the target fall back to resolving by url each time.
+// It may block in getaddrinfo, do not call it in handler threads.
+bool resolve_target(RemoteTarget &target);
+
 class FcopyClient {
 public:
     using ReqType = FcopyRequest;
@@ -29,9 +70,12 @@ public:
     { }
 
     AwaiterType request(const std::string &host, unsigned short port, ReqType &&req) noexcept;
+    AwaiterType request(const RemoteTarget &target, ReqType &&req,
+                        unsigned stream_key = 0) noexcept;
 
     template<typename RequestMsg, typename ResponseMsg>
-    coke::Task<int> request(const RemoteTarget &target, RequestMsg &&req, ResponseMsg &resp) noexcept;
+    coke::Task<int> request(const RemoteTarget &target, RequestMsg &&req, ResponseMsg &resp,
+                            unsigned stream_key = 0) noexcept;
 
 private:
     FcopyClientParams params;
@@ -45,19 +89,28 @@ using FcopyProcessor = FcopyServerBase::ProcessorType;
 
 class FcopyServer : public FcopyServerBase {
 public:
-    FcopyServer(const WFServerParams &params, ProcessorType co_proc)
-      : FcopyServerBase(params, std::move(co_proc))
+    FcopyServer(const WFServerParams &params, ProcessorType co_proc,
+                const SocketParams &sock_params = SocketParams())
+      : FcopyServerBase(params, std::move(co_proc)), sock_params(sock_params)
     { }
+
+protected:
+    // accepted connections inherit the options of the listening socket
+    int create_listen_fd() override;
+
+private:
+    SocketParams sock_params;
 };
 
 template<typename RequestMsg, typename ResponseMsg>
 coke::Task<int> FcopyClient::request(const RemoteTarget &target,
-                                     RequestMsg &&req, ResponseMsg &resp) noexcept
+                                     RequestMsg &&req, ResponseMsg &resp,
+                                     unsigned stream_key) noexcept
 {
     FcopyRequest freq;
     freq.set_message(std::move(req));
 
-    auto res = co_await this->request(target.host, target.port, std::move(freq));
+    auto res = co_await this->request(target, std::move(freq), stream_key);
     if (res.state != coke::STATE_SUCCESS)
         co_return res.error;
 
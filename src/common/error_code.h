@@ -8,6 +8,7 @@ enum {
     ERR_ADDRESS_NO_ACCESS = 1025,      // Client ip no access
     ERR_NO_PARTITION = 1026,
     ERR_NO_FILE = 1027,
+    ERR_SERVER_BUSY = 1028,         // Memory budget exhausted, retry later
 };
 
 #endif // FCOPY_ERROR_CODE_H
@@ -0,0 +1,356 @@
+#include "common/fcopy_log.h"
+#include "common/utils.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr int LOG_FLUSH_INTERVAL_MS = 50;
+constexpr std::size_t LOG_LINE_SIZE = 1024;
+
+/**
+ * Byte ring with a single producer and a single consumer. The owner thread
+ * appends whole records, the flusher writes out everything between tail and
+ * head, both positions only grow.
+ */
+struct LogRing {
+    explicit LogRing(std::size_t size)
+        : buf(new char[size]), size(size)
+    { }
+
+    // Returns false if the record does not fit, sets half_full when the
+    // ring just crossed half of its size.
+    bool push(const char *data, std::size_t len, bool &half_full) {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        std::size_t t = tail.load(std::memory_order_acquire);
+        std::size_t used = h - t;
+
+        if (size - used < len) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        std::size_t off = h % size;
+        std::size_t first = std::min(len, size - off);
+
+        std::memcpy(buf.get() + off, data, first);
+        std::memcpy(buf.get(), data + first, len - first);
+        head.store(h + len, std::memory_order_release);
+
+        half_full = (used < size / 2 && used + len >= size / 2);
+        return true;
+    }
+
+    bool drain(FILE *fp) {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        std::size_t h = head.load(std::memory_order_acquire);
+
+        if (h == t)
+            return false;
+
+        std::size_t len = h - t;
+        std::size_t off = t % size;
+        std::size_t first = std::min(len, size - off);
+
+        std::fwrite(buf.get() + off, 1, first, fp);
+        if (len > first)
+            std::fwrite(buf.get(), 1, len - first, fp);
+
+        tail.store(h, std::memory_order_release);
+        return true;
+    }
+
+    std::unique_ptr<char[]> buf;
+    std::size_t size;
+    std::atomic<std::size_t> head{0};
+    std::atomic<std::size_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+// "yyyy-mm-dd HH:MM:SS." of the current second, formatted once per second
+struct TimeCache {
+    time_t sec{-1};
+    std::size_t len{0};
+    char buf[FCOPY_TIME_BUF_SIZE];
+};
+
+thread_local TimeCache time_cache;
+
+std::size_t format_time(char *out) {
+    struct timespec ts;
+    long usec;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (ts.tv_sec != time_cache.sec) {
+        struct tm tm;
+        int n;
+
+        localtime_r(&ts.tv_sec, &tm);
+        n = snprintf(time_cache.buf, FCOPY_TIME_BUF_SIZE,
+            "%04d-%02d-%02d %02d:%02d:%02d.",
+            tm.tm_year + 1900, tm.tm_mon+1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec
+        );
+
+        time_cache.len = std::min<std::size_t>(n, FCOPY_TIME_BUF_SIZE - 7);
+        time_cache.sec = ts.tv_sec;
+    }
+
+    std::memcpy(out, time_cache.buf, time_cache.len);
+
+    usec = ts.tv_nsec / 1000;
+    for (int i = 5; i >= 0; i--) {
+        out[time_cache.len + i] = '0' + usec % 10;
+        usec /= 10;
+    }
+
+    return time_cache.len + 6;
+}
+
+// "[time] [LEVEL] ", returns the length written
+std::size_t format_prefix(char *out, const char *level) {
+    std::size_t pos = 0;
+    std::size_t level_len = std::strlen(level);
+
+    out[pos++] = '[';
+    pos += format_time(out + pos);
+    std::memcpy(out + pos, "] [", 3);
+    pos += 3;
+    std::memcpy(out + pos, level, level_len);
+    pos += level_len;
+    std::memcpy(out + pos, "] ", 2);
+    pos += 2;
+
+    return pos;
+}
+
+class AsyncLog {
+public:
+    ~AsyncLog() { stop(); }
+
+    int start(std::size_t ring_size);
+    void stop();
+
+    LogRing *get_ring();
+
+    void notify() { cv.notify_one(); }
+
+private:
+    void run();
+    void flush_locked();
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    std::thread flusher;
+    std::size_t ring_size{0};
+    bool stopping{false};
+
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> generation{0};
+};
+
+AsyncLog async_log;
+
+thread_local std::shared_ptr<LogRing> local_ring;
+thread_local uint64_t local_generation = 0;
+
+int AsyncLog::start(std::size_t ring_size) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (flusher.joinable())
+        return EBUSY;
+
+    this->ring_size = ring_size;
+    stopping = false;
+
+    try {
+        flusher = std::thread(&AsyncLog::run, this);
+    }
+    catch (const std::system_error &e) {
+        return e.code().value();
+    }
+
+    generation.fetch_add(1, std::memory_order_relaxed);
+    running.store(true, std::memory_order_release);
+    return 0;
+}
+
+void AsyncLog::stop() {
+    std::unique_lock<std::mutex> lk(mtx);
+
+    if (!flusher.joinable())
+        return;
+
+    running.store(false, std::memory_order_release);
+    stopping = true;
+    lk.unlock();
+
+    cv.notify_one();
+    flusher.join();
+
+    lk.lock();
+    flush_locked();
+    rings.clear();
+}
+
+LogRing *AsyncLog::get_ring() {
+    if (!running.load(std::memory_order_acquire))
+        return nullptr;
+
+    uint64_t gen = generation.load(std::memory_order_relaxed);
+    if (local_ring && local_generation == gen)
+        return local_ring.get();
+
+    std::lock_guard<std::mutex> lg(mtx);
+    if (stopping || !flusher.joinable())
+        return nullptr;
+
+    try {
+        auto ring = std::make_shared<LogRing>(ring_size);
+        rings.push_back(ring);
+        local_ring = std::move(ring);
+        local_generation = gen;
+    }
+    catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+
+    return local_ring.get();
+}
+
+void AsyncLog::run() {
+    std::unique_lock<std::mutex> lk(mtx);
+
+    while (!stopping) {
+        cv.wait_for(lk, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        flush_locked();
+    }
+
+    flush_locked();
+}
+
+void AsyncLog::flush_locked() {
+    FILE *fp = fcopy_log_file;
+    uint64_t dropped = 0;
+    std::size_t i = 0;
+
+    if (fp == nullptr)
+        return;
+
+    while (i < rings.size()) {
+        LogRing *ring = rings[i].get();
+
+        ring->drain(fp);
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+
+        // the owner thread has exited and everything is written
+        if (rings[i].use_count() == 1 && !ring->drain(fp)) {
+            rings[i] = std::move(rings.back());
+            rings.pop_back();
+        }
+        else
+            ++i;
+    }
+
+    if (dropped > 0) {
+        char line[LOG_LINE_SIZE];
+        std::size_t pos = format_prefix(line, "WARN");
+        int n = snprintf(line + pos, LOG_LINE_SIZE - pos,
+            "LogDropped records:%lu\n", (unsigned long)dropped);
+
+        std::fwrite(line, 1, pos + n, fp);
+    }
+}
+
+} // namespace
+
+void fcopy_get_time_str(char time_buf[FCOPY_TIME_BUF_SIZE]) {
+    std::size_t len = format_time(time_buf);
+    time_buf[len] = '\0';
+}
+
+int fcopy_start_async_log(std::size_t ring_size) {
+    if (ring_size == 0)
+        return EINVAL;
+
+    return async_log.start(ring_size);
+}
+
+void fcopy_stop_async_log() {
+    async_log.stop();
+}
+
+void fcopy_log_write(const char *level, const char *fmt, ...) {
+    char line[LOG_LINE_SIZE];
+    std::string long_line;
+    const char *data = line;
+    std::size_t pos, len;
+    va_list ap, ap2;
+    int n;
+
+    pos = format_prefix(line, level);
+
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    n = vsnprintf(line + pos, LOG_LINE_SIZE - pos, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        va_end(ap2);
+        return;
+    }
+
+    len = pos + n;
+    if (len + 1 < LOG_LINE_SIZE) {
+        line[len++] = '\n';
+    }
+    else {
+        long_line.assign(line, pos);
+        long_line.resize(len + 1);
+        vsnprintf(long_line.data() + pos, n + 1, fmt, ap2);
+        long_line[len++] = '\n';
+        data = long_line.data();
+    }
+    va_end(ap2);
+
+    LogRing *ring = async_log.get_ring();
+    if (ring) {
+        bool half_full = false;
+
+        if (ring->push(data, len, half_full) && half_full)
+            async_log.notify();
+    }
+    else
+        std::fwrite(data, 1, len, fcopy_log_file);
+}
+
+bool fcopy_log_allow(FcopyLogLimit &limit, int64_t interval_ms,
+                     uint64_t &suppressed)
+{
+    int64_t now = current_usec();
+    int64_t next = limit.next_usec.load(std::memory_order_relaxed);
+
+    if (now < next || !limit.next_usec.compare_exchange_strong(next,
+            now + interval_ms * 1000, std::memory_order_relaxed))
+    {
+        limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    suppressed = limit.suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
@@ -1,6 +1,9 @@
 #ifndef FCOPY_LOG_H
 #define FCOPY_LOG_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cerrno>
 
@@ -11,6 +14,12 @@ constexpr inline int FCOPY_LOG_LEVEL_DEBUG  = 2;
 constexpr inline int FCOPY_LOG_LEVEL_TRACE  = 1;
 constexpr inline int FCOPY_TIME_BUF_SIZE    = 32;
 
+// Levels below FCOPY_LOG_MIN_LEVEL are removed at compile time,
+// e.g. -DFCOPY_LOG_MIN_LEVEL=3 drops DEBUG and TRACE.
+#ifndef FCOPY_LOG_MIN_LEVEL
+#define FCOPY_LOG_MIN_LEVEL 1
+#endif
+
 inline int fcopy_log_level = 0;
 inline FILE *fcopy_log_file = nullptr;
 
@@ -22,7 +31,22 @@ inline int fcopy_get_log_level() {
     return fcopy_log_level;
 }
 
+/**
+ * Start a background thread that flushes the log file. Each thread that
+ * logs gets a ring of `ring_size` bytes, records that do not fit are dropped
+ * and counted. Returns 0 on success or an errno.
+ */
+int fcopy_start_async_log(std::size_t ring_size);
+
+/**
+ * Stop the background thread and write out everything that is buffered,
+ * later records are written synchronously.
+ */
+void fcopy_stop_async_log();
+
 inline void fcopy_close_log_file() {
+    fcopy_stop_async_log();
+
     if (fcopy_log_file)
         std::fclose(fcopy_log_file);
     fcopy_log_file = nullptr;
@@ -43,11 +67,38 @@ inline void fcopy_set_log_stream(FILE *log_file) {
 
 void fcopy_get_time_str(char time_buf[FCOPY_TIME_BUF_SIZE]);
 
+void fcopy_log_write(const char *level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+struct FcopyLogLimit {
+    std::atomic<int64_t> next_usec{0};
+    std::atomic<uint64_t> suppressed{0};
+};
+
+/**
+ * Return whether a rate limited callsite may log now, and if so the number
+ * of records it suppressed since the last one.
+ */
+bool fcopy_log_allow(FcopyLogLimit &limit, int64_t interval_ms,
+                     uint64_t &suppressed);
+
+#define FCOPY_LOG_ENABLED(level) \
+    (FCOPY_LOG_LEVEL_##level >= FCOPY_LOG_MIN_LEVEL && fcopy_log_file && \
+     FCOPY_LOG_LEVEL_##level >= fcopy_get_log_level())
+
 #define FLOG(level, fmt, ...) do { \
-    if (fcopy_log_file && FCOPY_LOG_LEVEL_##level >= fcopy_get_log_level()) { \
-        char time_buf[FCOPY_TIME_BUF_SIZE]; \
-        fcopy_get_time_str(time_buf); \
-        std::fprintf(fcopy_log_file, "[%s] [%s] " fmt "\n", time_buf, #level, ##__VA_ARGS__); \
+    if (FCOPY_LOG_ENABLED(level)) \
+        fcopy_log_write(#level, fmt, ##__VA_ARGS__); \
+} while (0)
+
+// Log at most once per `ms` milliseconds from this callsite.
+#define FLOG_EVERY_MS(level, ms, fmt, ...) do { \
+    if (FCOPY_LOG_ENABLED(level)) { \
+        static FcopyLogLimit flog_limit; \
+        uint64_t flog_suppressed; \
+        if (fcopy_log_allow(flog_limit, ms, flog_suppressed)) \
+            fcopy_log_write(#level, fmt " suppressed:%lu", ##__VA_ARGS__, \
+                            (unsigned long)flog_suppressed); \
     } \
 } while (0)
 
@@ -0,0 +1,45 @@
+#ifndef FCOPY_MEMORY_BUDGET_H
+#define FCOPY_MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+
+// Process wide budget of in-flight message data, 0 means no limit.
+inline std::atomic<std::size_t> fcopy_budget_limit{0};
+inline std::atomic<std::size_t> fcopy_budget_used{0};
+
+inline void fcopy_set_memory_budget(std::size_t limit) {
+    fcopy_budget_limit = limit;
+}
+
+inline std::size_t fcopy_get_memory_budget() {
+    return fcopy_budget_limit;
+}
+
+inline std::size_t fcopy_get_memory_used() {
+    return fcopy_budget_used;
+}
+
+inline bool fcopy_budget_acquire(std::size_t size) {
+    std::size_t limit = fcopy_budget_limit.load(std::memory_order_relaxed);
+    std::size_t used = fcopy_budget_used.load(std::memory_order_relaxed);
+
+    if (limit == 0) {
+        fcopy_budget_used.fetch_add(size, std::memory_order_relaxed);
+        return true;
+    }
+
+    do {
+        if (used + size > limit)
+            return false;
+    } while (!fcopy_budget_used.compare_exchange_weak(used, used + size,
+                                                      std::memory_order_relaxed));
+
+    return true;
+}
+
+inline void fcopy_budget_release(std::size_t size) {
+    fcopy_budget_used.fetch_sub(size, std::memory_order_relaxed);
+}
+
+#endif // FCOPY_MEMORY_BUDGET_H
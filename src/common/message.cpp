@@ -6,6 +6,13 @@
 #include <type_traits>
 
 #include "common/message.h"
+#include "common/utils.h"
+
+static DataSinkFunc data_sink;
+
+void fcopy_set_data_sink(DataSinkFunc func) {
+    data_sink = std::move(func);
+}
 
 static bool create_message(std::unique_ptr<MessageBase> &ptr, Command cmd) {
     switch (cmd) {
@@ -13,13 +20,19 @@ static bool create_message(std::unique_ptr<MessageBase> &ptr, Command cmd) {
     case Command::SEND_FILE_REQ:    ptr.reset(new SendFileReq());       break;
     case Command::CLOSE_FILE_REQ:   ptr.reset(new CloseFileReq());      break;
     case Command::DELETE_FILE_REQ:  ptr.reset(new DeleteFileReq());     break;
+    case Command::COMMIT_DIR_REQ:   ptr.reset(new CommitDirReq());      break;
     case Command::SET_CHAIN_REQ:    ptr.reset(new SetChainReq());       break;
+    case Command::STATS_REQ:        ptr.reset(new StatsReq());          break;
+    case Command::GET_TRACE_REQ:    ptr.reset(new GetTraceReq());       break;
 
     case Command::CREATE_FILE_RESP: ptr.reset(new CreateFileResp());    break;
     case Command::SEND_FILE_RESP:   ptr.reset(new SendFileResp());      break;
     case Command::CLOSE_FILE_RESP:  ptr.reset(new CloseFileResp());     break;
     case Command::DELETE_FILE_RESP: ptr.reset(new DeleteFileResp());    break;
+    case Command::COMMIT_DIR_RESP:  ptr.reset(new CommitDirResp());     break;
     case Command::SET_CHAIN_RESP:   ptr.reset(new SetChainResp());      break;
+    case Command::STATS_RESP:       ptr.reset(new StatsResp());         break;
+    case Command::GET_TRACE_RESP:   ptr.reset(new GetTraceResp());      break;
 
     default:
         return false;
@@ -109,13 +122,16 @@ MessageBase::MessageBase(Command cmd, int16_t error) {
     this->body_len  = 0;
     this->data_len  = 0;
     this->data_pos  = 0;
+    this->rejected  = false;
+    this->recv_start = 0;
 }
 
 bool MessageBase::set_data(const std::string_view &d) {
     void *buf;
     data_pos = d.size();
     data_len = d.size();
-    data.reset();
+    data = DataPtr();
+    sink.reset();
 
     if (d.empty()) {
         data_view = std::string_view();
@@ -126,7 +142,7 @@ bool MessageBase::set_data(const std::string_view &d) {
             return false;
 
         std::memcpy(buf, d.data(), d.size());
-        data.reset(reinterpret_cast<char *>(buf));
+        data = DataPtr(reinterpret_cast<char *>(buf));
         data_view = std::string_view(data.get(), d.size());
     }
 
@@ -136,7 +152,8 @@ bool MessageBase::set_data(const std::string_view &d) {
 bool MessageBase::set_data_view(const std::string_view &d) {
     data_pos = d.size();
     data_len = d.size();
-    data.reset();
+    data = DataPtr();
+    sink.reset();
     data_view = d;
     return true;
 }
@@ -179,6 +196,9 @@ int MessageBase::decode_head(const std::string &head) noexcept {
 int MessageBase::append_body(const char *buf, size_t size) noexcept {
     std::size_t n;
 
+    if (recv_start == 0)
+        recv_start = current_usec();
+
     if (body.size() < body_len) {
         if (body.capacity() < body_len)
             body.reserve(body_len);
@@ -193,24 +213,40 @@ int MessageBase::append_body(const char *buf, size_t size) noexcept {
     }
 
     if (data_pos < data_len) {
-        char *p = data.get();
+        char *p = sink ? sink.get() : data.get();
 
-        if (!p) {
-            p = static_cast<char *>(std::aligned_alloc(FCOPY_CHUNK_BASE, data_len));
-            data.reset(p);
+        if (!p && !rejected && data_pos == 0) {
+            sink = get_data_sink();
+            p = sink.get();
+        }
 
-            if (!p)
-                return -1;
+        if (!p && !rejected) {
+            // drain the data without buffering it if the budget is exhausted,
+            // the handler replies a retryable error
+            if (!fcopy_budget_acquire(data_len)) {
+                rejected = true;
+            }
+            else {
+                p = static_cast<char *>(fcopy_chunk_alloc(data_len));
+                if (!p) {
+                    fcopy_budget_release(data_len);
+                    return -1;
+                }
+
+                data = DataPtr(p, DataDeleter{data_len});
+            }
         }
 
         n = std::min<std::size_t>(size, data_len - data_pos);
-        std::memcpy(p + data_pos, buf, n);
+        if (p)
+            std::memcpy(p + data_pos, buf, n);
         data_pos += n;
 
         if (data_pos < data_len)
             return 0;
 
-        data_view = std::string_view(data.get(), data_len);
+        if (p)
+            data_view = std::string_view(p, data_len);
     }
 
     return decode_body();
@@ -234,6 +270,15 @@ int CreateFileReq::decode_body() noexcept {
     FAIL_IF(decode_string(body, pos, relative_path));
     FAIL_IF(decode_string(body, pos, file_name));
 
+    // optional trailing fields, absent when sent by older clients
+    if (pos < body.size()) {
+        FAIL_IF(decode_int(body, pos, atomic));
+        FAIL_IF(decode_string(body, pos, commit_dir));
+    }
+
+    if (pos < body.size())
+        FAIL_IF(decode_string(body, pos, sched_class));
+
     return (pos == body.size()) ? 1 : -1;
 }
 
@@ -245,6 +290,14 @@ int CreateFileReq::encode_body(struct iovec vectors[], int max) noexcept {
     append_string(body, relative_path);
     append_string(body, file_name);
 
+    if (atomic || !commit_dir.empty() || !sched_class.empty()) {
+        append_int(body, atomic);
+        append_string(body, commit_dir);
+    }
+
+    if (!sched_class.empty())
+        append_string(body, sched_class);
+
     vectors->iov_base = body.data();
     vectors->iov_len = body.size();
 
@@ -255,18 +308,31 @@ int CreateFileResp::decode_body() noexcept {
     std::size_t pos = 0;
     FAIL_IF(decode_string(body, pos, file_token));
 
+    if (pos < body.size())
+        FAIL_IF(decode_int(body, pos, max_chunk_size));
+
     return (pos == body.size()) ? 1 : -1;
 }
 
 int CreateFileResp::encode_body(struct iovec vectors[], int max) noexcept {
     append_string(body, file_token);
 
+    if (max_chunk_size != 0)
+        append_int(body, max_chunk_size);
+
     vectors->iov_base = body.data();
     vectors->iov_len = body.size();
 
     return 1;
 }
 
+std::shared_ptr<char> SendFileReq::get_data_sink() noexcept {
+    if (!data_sink || decode_body() < 0 || compress_type != 0)
+        return nullptr;
+
+    return data_sink(file_token, offset, data_len);
+}
+
 int SendFileReq::decode_body() noexcept {
     std::size_t pos = 0;
 
@@ -277,6 +343,9 @@ int SendFileReq::decode_body() noexcept {
     FAIL_IF(decode_int(body, pos, offset));
     FAIL_IF(decode_string(body, pos, file_token));
 
+    if (pos < body.size())
+        FAIL_IF(decode_int(body, pos, trace_id));
+
     return (pos == body.size()) ? 1 : -1;
 }
 
@@ -288,6 +357,9 @@ int SendFileReq::encode_body(struct iovec vectors[], int max) noexcept {
     append_int(body, offset);
     append_string(body, file_token);
 
+    if (trace_id != 0)
+        append_int(body, trace_id);
+
     vectors[0].iov_base = body.data();
     vectors[0].iov_len = body.size();
 
@@ -352,6 +424,26 @@ int DeleteFileReq::encode_body(struct iovec vectors[], int max) noexcept {
     return 1;
 }
 
+int CommitDirReq::decode_body() noexcept {
+    std::size_t pos = 0;
+    FAIL_IF(decode_int(body, pos, discard));
+    FAIL_IF(decode_string(body, pos, partition));
+    FAIL_IF(decode_string(body, pos, commit_dir));
+
+    return (pos == body.size()) ? 1 : -1;
+}
+
+int CommitDirReq::encode_body(struct iovec vectors[], int max) noexcept {
+    append_int(body, discard);
+    append_string(body, partition);
+    append_string(body, commit_dir);
+
+    vectors->iov_base = body.data();
+    vectors->iov_len = body.size();
+
+    return 1;
+}
+
 int SetChainReq::decode_body() noexcept {
     std::size_t pos = 0;
     uint32_t size;
@@ -385,6 +477,76 @@ int SetChainReq::encode_body(struct iovec vectors[], int max) noexcept {
     return 1;
 }
 
+int StatsResp::decode_body() noexcept {
+    std::size_t pos = 0;
+    FAIL_IF(decode_string(body, pos, text));
+
+    return (pos == body.size()) ? 1 : -1;
+}
+
+int StatsResp::encode_body(struct iovec vectors[], int max) noexcept {
+    append_string(body, text);
+
+    vectors->iov_base = body.data();
+    vectors->iov_len = body.size();
+
+    return 1;
+}
+
+int GetTraceReq::decode_body() noexcept {
+    std::size_t pos = 0;
+    FAIL_IF(decode_string(body, pos, file_token));
+
+    return (pos == body.size()) ? 1 : -1;
+}
+
+int GetTraceReq::encode_body(struct iovec vectors[], int max) noexcept {
+    append_string(body, file_token);
+
+    vectors->iov_base = body.data();
+    vectors->iov_len = body.size();
+
+    return 1;
+}
+
+int GetTraceResp::decode_body() noexcept {
+    std::size_t pos = 0;
+    uint32_t size;
+    FAIL_IF(decode_int(body, pos, size));
+
+    for (uint32_t i = 0; i < size; i++) {
+        TraceSpan s;
+        uint64_t start, dur;
+        FAIL_IF(decode_int(body, pos, s.trace_id));
+        FAIL_IF(decode_int(body, pos, s.offset));
+        FAIL_IF(decode_int(body, pos, start));
+        FAIL_IF(decode_int(body, pos, dur));
+        FAIL_IF(decode_string(body, pos, s.name));
+
+        s.start = (int64_t)start;
+        s.dur = (int64_t)dur;
+        spans.push_back(std::move(s));
+    }
+
+    return (pos == body.size()) ? 1 : -1;
+}
+
+int GetTraceResp::encode_body(struct iovec vectors[], int max) noexcept {
+    append_int(body, (uint32_t)spans.size());
+    for (const TraceSpan &s : spans) {
+        append_int(body, s.trace_id);
+        append_int(body, s.offset);
+        append_int(body, (uint64_t)s.start);
+        append_int(body, (uint64_t)s.dur);
+        append_string(body, s.name);
+    }
+
+    vectors->iov_base = body.data();
+    vectors->iov_len = body.size();
+
+    return 1;
+}
+
 int FcopyMessage::encode(struct iovec vectors[], int max) {
     if (!message) {
         errno = EBADMSG;
@@ -6,8 +6,11 @@
 #include <string_view>
 #include <vector>
 #include <memory>
+#include <functional>
 
 #include "common/structures.h"
+#include "common/memory_budget.h"
+#include "common/chunk_pool.h"
 #include "workflow/ProtocolMessage.h"
 
 // chunk_size should be multiple of FCOPY_CHUNK_BASE
@@ -20,23 +23,47 @@ enum class Command : uint16_t {
     SEND_FILE_REQ       = 0x0002,
     CLOSE_FILE_REQ      = 0x0003,
     DELETE_FILE_REQ     = 0x0004,
+    COMMIT_DIR_REQ      = 0x0005,
 
     SET_CHAIN_REQ       = 0x0011,
 
+    STATS_REQ           = 0x0021,
+    GET_TRACE_REQ       = 0x0022,
+
     CREATE_FILE_RESP    = 0x1001,
     SEND_FILE_RESP      = 0x1002,
     CLOSE_FILE_RESP     = 0x1003,
     DELETE_FILE_RESP    = 0x1004,
+    COMMIT_DIR_RESP     = 0x1005,
 
     SET_CHAIN_RESP      = 0x1011,
+
+    STATS_RESP          = 0x1021,
+    GET_TRACE_RESP      = 0x1022,
 };
 
 class MessageBase {
     struct DataDeleter {
-        void operator()(void *data) { std::free(data); }
+        DataDeleter() : charged(0) { }
+        explicit DataDeleter(std::size_t charged) : charged(charged) { }
+
+        void operator()(void *data) {
+            if (charged) {
+                fcopy_chunk_free(data, charged);
+                fcopy_budget_release(charged);
+            }
+            else
+                std::free(data);
+        }
+
+        // bytes charged to the memory budget, such buffers are received
+        // from network and come from the chunk pool
+        std::size_t charged;
     };
 
 public:
+    using DataPtr = std::unique_ptr<char, DataDeleter>;
+
     static constexpr uint16_t MAGIC         = 0xF1FAU;
     static constexpr uint16_t VERSION       = 1U;
     static constexpr uint16_t HEADER_SIZE   = 16U;
@@ -56,11 +83,25 @@ public:
     bool set_data(const std::string_view &d);
     bool set_data_view(const std::string_view &v);
 
+    // Take ownership of the data buffer, the data view stays valid as long as
+    // the returned pointer is alive. Returns nullptr if the data is a view.
+    DataPtr release_data() { return std::move(data); }
+
+    // the data is dropped because the memory budget is exhausted
+    bool is_rejected() const { return rejected; }
+
+    // the data is received into its destination by the data sink
+    bool is_sunk() const { return (bool)sink; }
+
+    // current_usec() when the header is received, 0 for local messages
+    int64_t get_recv_start() const { return recv_start; }
+
 protected:
     int encode_head(std::string &head) noexcept;
     int decode_head(const std::string &head) noexcept;
 
     int append_body(const char *buf, size_t size) noexcept;
+    virtual std::shared_ptr<char> get_data_sink() noexcept { return nullptr; }
     virtual int decode_body() noexcept;
     virtual int encode_body(struct iovec vectors[], int max) noexcept { return 0; }
 
@@ -75,11 +116,22 @@ protected:
     uint32_t data_len;
 
     uint32_t data_pos;
+    bool rejected;
+    int64_t recv_start;
     std::string body;
-    std::unique_ptr<char, DataDeleter> data;
+    DataPtr data;
+    std::shared_ptr<char> sink;
     std::string_view data_view;
 };
 
+// Servers may receive the data of a SendFileReq straight into its destination,
+// e.g. a mapped file. The sink is called once the body is received, and
+// returns the buffer of `size` bytes at `offset` of the file, or nullptr to
+// receive into a chunk buffer. Set it before any server starts.
+using DataSinkFunc = std::function<std::shared_ptr<char> (const std::string &file_token,
+                                                          uint64_t offset, std::size_t size)>;
+void fcopy_set_data_sink(DataSinkFunc func);
+
 class CreateFileReq : public MessageBase {
 public:
     constexpr static Command ReqCmd = Command::CREATE_FILE_REQ;
@@ -99,6 +151,16 @@ public:
     std::string partition;
     std::string relative_path;
     std::string file_name;
+
+    // write to a temp file and rename it to file_name when closed
+    uint8_t atomic {0};
+
+    // if not empty, the file is staged and published with the whole
+    // commit_dir by CommitDirReq, commit_dir is relative to partition
+    std::string commit_dir;
+
+    // scheduling class of the file on server, empty for the default class
+    std::string sched_class;
 };
 
 class CreateFileResp : public MessageBase {
@@ -115,6 +177,9 @@ protected:
 
 public:
     std::string file_token;
+
+    // the largest chunk the server accepts, 0 if unknown
+    uint32_t max_chunk_size {0};
 };
 
 class SendFileReq : public MessageBase {
@@ -151,6 +216,7 @@ public:
     }
 
 protected:
+    std::shared_ptr<char> get_data_sink() noexcept override;
     int decode_body() noexcept override;
     int encode_body(struct iovec vectors[], int max) noexcept override;
 
@@ -161,6 +227,10 @@ public:
     uint32_t crc32         = 0;
     uint64_t offset        = 0;
     std::string file_token;
+
+    // non zero if the chunk is sampled for tracing, encoded only if set, so
+    // untraced chunks are understood by older servers
+    uint64_t trace_id      = 0;
 };
 
 class SendFileResp : public MessageBase {
@@ -235,6 +305,34 @@ public:
     DeleteFileResp() : MessageBase(ThisCmd) { }
 };
 
+class CommitDirReq : public MessageBase {
+public:
+    constexpr static Command ReqCmd = Command::COMMIT_DIR_REQ;
+    constexpr static Command RespCmd = Command::COMMIT_DIR_RESP;
+    constexpr static Command ThisCmd = Command::COMMIT_DIR_REQ;
+
+    CommitDirReq() : MessageBase(ThisCmd) { }
+
+protected:
+    int decode_body() noexcept override;
+    int encode_body(struct iovec vectors[], int max) noexcept override;
+
+public:
+    // remove the staged files instead of publishing them
+    uint8_t discard {0};
+    std::string partition;
+    std::string commit_dir;
+};
+
+class CommitDirResp : public MessageBase {
+public:
+    constexpr static Command ReqCmd = Command::COMMIT_DIR_REQ;
+    constexpr static Command RespCmd = Command::COMMIT_DIR_RESP;
+    constexpr static Command ThisCmd = Command::COMMIT_DIR_RESP;
+
+    CommitDirResp() : MessageBase(ThisCmd) { }
+};
+
 class SetChainReq : public MessageBase {
 public:
     constexpr static Command ReqCmd = Command::SET_CHAIN_REQ;
@@ -261,6 +359,66 @@ public:
     SetChainResp() : MessageBase(ThisCmd) { }
 };
 
+class StatsReq : public MessageBase {
+public:
+    constexpr static Command ReqCmd = Command::STATS_REQ;
+    constexpr static Command RespCmd = Command::STATS_RESP;
+    constexpr static Command ThisCmd = Command::STATS_REQ;
+
+    StatsReq() : MessageBase(ThisCmd) { }
+};
+
+class StatsResp : public MessageBase {
+public:
+    constexpr static Command ReqCmd = Command::STATS_REQ;
+    constexpr static Command RespCmd = Command::STATS_RESP;
+    constexpr static Command ThisCmd = Command::STATS_RESP;
+
+    StatsResp() : MessageBase(ThisCmd) { }
+
+protected:
+    int decode_body() noexcept override;
+    int encode_body(struct iovec vectors[], int max) noexcept override;
+
+public:
+    // metrics in the text format of prometheus
+    std::string text;
+};
+
+// fetch the spans recorded for sampled chunks of a file, the server forgets
+// them once fetched
+class GetTraceReq : public MessageBase {
+public:
+    constexpr static Command ReqCmd = Command::GET_TRACE_REQ;
+    constexpr static Command RespCmd = Command::GET_TRACE_RESP;
+    constexpr static Command ThisCmd = Command::GET_TRACE_REQ;
+
+    GetTraceReq() : MessageBase(ThisCmd) { }
+
+protected:
+    int decode_body() noexcept override;
+    int encode_body(struct iovec vectors[], int max) noexcept override;
+
+public:
+    std::string file_token;
+};
+
+class GetTraceResp : public MessageBase {
+public:
+    constexpr static Command ReqCmd = Command::GET_TRACE_REQ;
+    constexpr static Command RespCmd = Command::GET_TRACE_RESP;
+    constexpr static Command ThisCmd = Command::GET_TRACE_RESP;
+
+    GetTraceResp() : MessageBase(ThisCmd) { }
+
+protected:
+    int decode_body() noexcept override;
+    int encode_body(struct iovec vectors[], int max) noexcept override;
+
+public:
+    std::vector<TraceSpan> spans;
+};
+
 class FcopyMessage : public protocol::ProtocolMessage {
 public:
     FcopyMessage() { }
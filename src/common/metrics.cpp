@@ -0,0 +1,93 @@
+#include "common/metrics.h"
+
+#include <bit>
+
+std::size_t metrics_slot() {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t slot = next.fetch_add(1) % METRICS_SLOTS;
+
+    return slot;
+}
+
+uint64_t Counter::value() const {
+    uint64_t v = 0;
+
+    for (const Slot &s : slots)
+        v += s.v.load(std::memory_order_relaxed);
+
+    return v;
+}
+
+Histogram::Histogram() : slots(new Slot[METRICS_SLOTS]) {
+    for (std::size_t i = 0; i < METRICS_SLOTS; i++) {
+        for (auto &c : slots[i].counts)
+            c.store(0, std::memory_order_relaxed);
+        slots[i].sum.store(0, std::memory_order_relaxed);
+    }
+}
+
+int Histogram::bucket_of(uint64_t usec) {
+    if (usec < SUB_COUNT)
+        return (int)usec;
+
+    int e = std::bit_width(usec) - 1;
+    if (e >= MAX_EXP)
+        return BUCKETS - 1;
+
+    int sub = (int)(usec >> (e - SUB_BITS)) & (SUB_COUNT - 1);
+    return (e - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+uint64_t Histogram::bucket_max(int i) {
+    if (i < SUB_COUNT)
+        return (uint64_t)i;
+
+    int e = i / SUB_COUNT - 1 + SUB_BITS;
+    uint64_t sub = (uint64_t)(i % SUB_COUNT);
+
+    return ((SUB_COUNT + sub + 1) << (e - SUB_BITS)) - 1;
+}
+
+uint64_t Histogram::quantile(const uint64_t *counts, double q) {
+    uint64_t total = 0, cum = 0, rank;
+
+    for (int i = 0; i < BUCKETS; i++)
+        total += counts[i];
+
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t)(q * (double)total);
+    if (rank == 0)
+        rank = 1;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        cum += counts[i];
+        if (cum >= rank)
+            return bucket_max(i);
+    }
+
+    return bucket_max(BUCKETS - 1);
+}
+
+void Histogram::record(int64_t usec) {
+    Slot &s = slots[metrics_slot()];
+    uint64_t v = usec > 0 ? (uint64_t)usec : 0;
+
+    s.counts[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(v, std::memory_order_relaxed);
+}
+
+void Histogram::snapshot(uint64_t *counts, uint64_t &sum) const {
+    sum = 0;
+    for (int i = 0; i < BUCKETS; i++)
+        counts[i] = 0;
+
+    for (std::size_t j = 0; j < METRICS_SLOTS; j++) {
+        const Slot &s = slots[j];
+
+        for (int i = 0; i < BUCKETS; i++)
+            counts[i] += s.counts[i].load(std::memory_order_relaxed);
+        sum += s.sum.load(std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef FCOPY_COMMON_METRICS_H
+#define FCOPY_COMMON_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+// Counters and histograms are split into slots, each thread updates the slot
+// of its own and readers sum up all slots, so that hot counters do not bounce
+// one cache line between handler threads.
+constexpr std::size_t METRICS_SLOTS = 16;
+
+std::size_t metrics_slot();
+
+class Counter {
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> v{0};
+    };
+
+public:
+    void add(uint64_t n) {
+        slots[metrics_slot()].v.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+private:
+    Slot slots[METRICS_SLOTS];
+};
+
+// Histogram of latencies in microseconds. Like HDR histogram, each power of two
+// is split into linear sub buckets, so the relative error is below 1/8 at any
+// magnitude with a few hundred buckets.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int MAX_EXP = 40;
+    static constexpr int BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB_COUNT;
+
+    Histogram();
+    Histogram(const Histogram &) = delete;
+
+    void record(int64_t usec);
+
+    // merged counts of all slots, `counts` has BUCKETS elements
+    void snapshot(uint64_t *counts, uint64_t &sum) const;
+
+    // the value at quantile `q` in [0, 1] of a snapshot, 0 if it is empty
+    static uint64_t quantile(const uint64_t *counts, double q);
+
+    static int bucket_of(uint64_t usec);
+    // the largest value of bucket `i`
+    static uint64_t bucket_max(int i);
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> counts[BUCKETS];
+        std::atomic<uint64_t> sum;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+};
+
+#endif // FCOPY_COMMON_METRICS_H
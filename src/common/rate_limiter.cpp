@@ -0,0 +1,99 @@
+#include "common/rate_limiter.h"
+
+#include <algorithm>
+
+#include "coke/sleep.h"
+#include "common/utils.h"
+
+RateLimiter::RateLimiter(std::size_t rate, std::size_t burst)
+    : rate(0), burst(0), tokens(0), last_usec(current_usec())
+{
+    set_rate(rate, burst);
+}
+
+void RateLimiter::set_rate(std::size_t rate, std::size_t burst) {
+    std::lock_guard<std::mutex> lg(mtx);
+    bool was_limited = (this->rate != 0);
+
+    this->rate = rate;
+    this->burst = (burst != 0) ? burst : rate / 10;
+
+    if (!was_limited)
+        tokens = (double)this->burst;
+    else
+        tokens = std::min(tokens, (double)this->burst);
+}
+
+std::size_t RateLimiter::get_rate() {
+    std::lock_guard<std::mutex> lg(mtx);
+    return rate;
+}
+
+int64_t RateLimiter::reserve(std::size_t size) {
+    return reserve(size, current_usec());
+}
+
+int64_t RateLimiter::reserve(std::size_t size, int64_t now) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (rate == 0) {
+        last_usec = now;
+        return 0;
+    }
+
+    tokens += (double)(now - last_usec) * rate / 1.0e6;
+    tokens = std::min(tokens, (double)burst);
+    last_usec = now;
+
+    tokens -= (double)size;
+    if (tokens >= 0)
+        return 0;
+
+    return (int64_t)(-tokens * 1.0e6 / rate);
+}
+
+coke::Task<> RateLimiter::get(std::size_t size) {
+    int64_t delay = reserve(size);
+
+    if (delay > 0)
+        co_await coke::sleep(std::chrono::microseconds(delay));
+}
+
+LinkRateLimiter::LinkRateLimiter(const LinkRateParams &params)
+    : global(params.rate, params.burst), params(params)
+{
+    limited = (params.rate != 0 || params.link_rate != 0);
+}
+
+void LinkRateLimiter::set_params(const LinkRateParams &params) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    this->params = params;
+    global.set_rate(params.rate, params.burst);
+    limited = (params.rate != 0 || params.link_rate != 0);
+
+    for (auto &it : links)
+        it.second->set_rate(params.link_rate, params.link_burst);
+}
+
+coke::Task<> LinkRateLimiter::get(const std::string &host, unsigned short port,
+                                  std::size_t size) {
+    int64_t delay = global.reserve(size);
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+
+        if (params.link_rate != 0) {
+            std::string key = host + ":" + std::to_string(port);
+            auto &link = links[key];
+
+            if (!link)
+                link = std::make_unique<RateLimiter>(params.link_rate, params.link_burst);
+
+            delay = std::max(delay, link->reserve(size));
+        }
+    }
+
+    if (delay > 0)
+        co_await coke::sleep(std::chrono::microseconds(delay));
+}
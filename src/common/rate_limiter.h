@@ -0,0 +1,70 @@
+#ifndef FCOPY_RATE_LIMITER_H
+#define FCOPY_RATE_LIMITER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "coke/global.h"
+
+struct LinkRateParams {
+    // bytes per second of all links and of each link, 0 means no limit,
+    // burst 0 means a tenth of the rate
+    std::size_t rate        = 0;
+    std::size_t burst       = 0;
+    std::size_t link_rate   = 0;
+    std::size_t link_burst  = 0;
+};
+
+// RateLimiter is a token bucket in bytes. A request larger than the tokens
+// left makes the bucket go into debt, and the caller waits until it is repaid.
+class RateLimiter {
+public:
+    RateLimiter(std::size_t rate = 0, std::size_t burst = 0);
+    RateLimiter(const RateLimiter &) = delete;
+
+    // can be called at any time, 0 rate means no limit
+    void set_rate(std::size_t rate, std::size_t burst);
+    std::size_t get_rate();
+
+    // take `size` bytes, return microseconds the caller should wait
+    int64_t reserve(std::size_t size);
+    // the same at steady time `now`, for callers with a clock of their own
+    int64_t reserve(std::size_t size, int64_t now);
+
+    coke::Task<> get(std::size_t size);
+
+private:
+    std::mutex mtx;
+    std::size_t rate;
+    std::size_t burst;
+    double tokens;
+    int64_t last_usec;
+};
+
+// LinkRateLimiter limits bytes on all links and on each host:port link.
+class LinkRateLimiter {
+public:
+    LinkRateLimiter(const LinkRateParams &params = LinkRateParams());
+    LinkRateLimiter(const LinkRateLimiter &) = delete;
+
+    void set_params(const LinkRateParams &params);
+
+    // whether any limit is set, callers may skip get if not
+    bool is_limited() const { return limited; }
+
+    coke::Task<> get(const std::string &host, unsigned short port, std::size_t size);
+
+private:
+    RateLimiter global;
+    std::atomic<bool> limited;
+
+    std::mutex mtx;
+    LinkRateParams params;
+    std::map<std::string, std::unique_ptr<RateLimiter>> links;
+};
+
+#endif // FCOPY_RATE_LIMITER_H
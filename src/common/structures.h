@@ -14,9 +14,42 @@ struct ChainTarget {
 
 using ChainTargets = std::vector<ChainTarget>;
 
+// a phase of a sampled chunk, in wall clock microseconds since epoch, so that
+// spans of different hosts can be merged, up to their clock skew
+struct TraceSpan {
+    uint64_t trace_id;
+    uint64_t offset;
+    int64_t start;
+    int64_t dur;
+    std::string name;
+};
+
+enum {
+    PARTITION_SYNC_NONE     = 0,
+    PARTITION_SYNC_CLOSE    = 1,    // fdatasync when a file is closed
+    PARTITION_SYNC_WRITE    = 2,    // open files with O_DSYNC
+};
+
+// storage policy of a partition, see partition-policy in fcopy.conf
+struct PartitionPolicy {
+    int directio            = -1;   // -1 follows the global directio
+    bool sync_engine        = false; // blocking pwrite on go threads instead of aio
+    int queue_depth         = 0;    // blocking operations at once, 0 means no limit
+    int sync_mode           = PARTITION_SYNC_NONE;
+    std::size_t rate_limit  = 0;    // bytes written per second, 0 means no limit
+    bool null_sink          = false; // discard chunks instead of writing, still forward
+};
+
 struct FsPartition {
     std::string name;
     std::string root_path;
+    PartitionPolicy policy;
+};
+
+struct SchedClass {
+    std::string name;
+    unsigned weight;
+    std::size_t rate_limit; // bytes per second, 0 means no limit
 };
 
 struct FcopyConfig {
@@ -26,16 +59,57 @@ struct FcopyConfig {
     int port        = 5200;
     int loglevel    = 0;
 
+    // listening sockets on the port, more than one uses SO_REUSEPORT
+    int listeners   = 1;
+
+    // prometheus metrics over http, 0 means disabled
+    int metrics_port = 0;
+
+    int poller_threads  = 8;
+    int handler_threads = 12;
+
+    // bind threads and memory to the numa node, or the node of the network
+    // interface, -1 and empty means no binding
+    int numa_node       = -1;
+    std::string numa_interface;
+
     int srv_max_conn                = 4096;
     int srv_peer_response_timeout   = 10 * 1000;
     int srv_receive_timeout         = -1;
     int srv_keep_alive_timeout      = 300 * 1000;
     std::size_t srv_size_limit      = 128ULL << 20;
+    std::size_t srv_memory_budget   = 0;
+    std::size_t srv_chunk_pool_size = 0;
+
+    bool receive_mmap                   = false;
+    bool write_coalesce                 = false;
+    bool coalesce_buffered_ack          = false;
+    std::size_t coalesce_window_size    = 64ULL << 20;
+    std::size_t coalesce_flush_size     = 16ULL << 20;
+
+    std::size_t fwd_speed_limit         = 0;
+    std::size_t fwd_speed_burst         = 0;
+    std::size_t fwd_link_speed_limit    = 0;
+    std::size_t fwd_link_speed_burst    = 0;
+
+    int sched_disk_concurrency  = 4;
+    int sched_net_concurrency   = 16;
+    std::map<std::string, SchedClass> sched_classes;
 
     int cli_retry_max           = 2;
     int cli_send_timeout        = -1;
     int cli_receive_timeout     = -1;
     int cli_keep_alive_timeout  = 300 * 1000;
+    int cli_streams             = 1;
+
+    std::size_t sock_send_buffer    = 0;
+    std::size_t sock_recv_buffer    = 0;
+    std::size_t tcp_notsent_lowat   = 0;
+    std::string tcp_congestion;
+
+    // per thread log buffer flushed by a background thread, 0 means
+    // writing each record synchronously
+    std::size_t log_buffer_size     = 256ULL << 10;
 
     std::string logfile;
     std::string pidfile;
@@ -44,6 +118,9 @@ struct FcopyConfig {
 
     std::string default_partition;
     std::map<std::string, FsPartition> partitions;
+
+    // by partition name, `default` is the policy of default partition
+    std::map<std::string, PartitionPolicy> partition_policies;
 };
 
 #endif // FCOPY_STRUCTURES_H
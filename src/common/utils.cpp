@@ -1,36 +1,101 @@
 #include "common/utils.h"
-#include "common/fcopy_log.h"
 
 #include <sstream>
+#include <algorithm>
+#include <cmath>
 #include <iomanip>
-#include <set>
-#include <ctime>
+#include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <sched.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/mempolicy.h>
 
 namespace fs = std::filesystem;
 
-void fcopy_get_time_str(char time_buf[FCOPY_TIME_BUF_SIZE]) {
-    struct timespec ts;
-    struct tm tm;
-
-    clock_gettime(CLOCK_REALTIME, &ts);
-    localtime_r(&ts.tv_sec, &tm);
-
-    snprintf(time_buf, FCOPY_TIME_BUF_SIZE,
-        "%04d-%02d-%02d %02d:%02d:%02d.%06ld",
-        tm.tm_year + 1900, tm.tm_mon+1, tm.tm_mday,
-        tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000
-    );
-}
-
 int64_t current_usec() {
     auto dur = std::chrono::steady_clock::now().time_since_epoch();
     auto usec = std::chrono::duration_cast<std::chrono::microseconds>(dur);
     return usec.count();
 }
 
+int64_t realtime_usec() {
+    auto dur = std::chrono::system_clock::now().time_since_epoch();
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(dur);
+    return usec.count();
+}
+
+std::string json_quote(const std::string &s) {
+    std::string out("\"");
+    char buf[8];
+
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if (c < 0x20) {
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out.append(buf);
+        }
+        else
+            out.push_back(c);
+    }
+
+    out.push_back('"');
+    return out;
+}
+
+std::vector<std::string> split_string(const std::string &s, char sep) {
+    std::vector<std::string> v;
+    std::size_t start = 0, pos;
+
+    while ((pos = s.find(sep, start)) != std::string::npos) {
+        v.push_back(s.substr(start, pos - start));
+        start = pos + 1;
+    }
+
+    v.push_back(s.substr(start));
+    return v;
+}
+
+bool parse_bytes(const std::string &s, std::size_t &size) {
+    std::size_t pos = 0;
+    double u;
+    int m = 0;
+
+    try {
+        u = std::stod(s, &pos);
+    }
+    catch (const std::exception &) {
+        return false;
+    }
+
+    if (pos + 1 == s.size()) {
+        switch (s[pos]) {
+        case 'K': m = 10; break;
+        case 'M': m = 20; break;
+        case 'G': m = 30; break;
+        case 'T': m = 40; break;
+        default: return false;
+        }
+    }
+    else if (pos != s.size())
+        return false;
+
+    u = std::ceil(std::ldexp(u, m));
+    if (!std::isfinite(u) || u <= 0 || u > std::ldexp(1.0, 50))
+        return false;
+
+    size = (std::size_t)u;
+    return true;
+}
+
 std::string format_bps(std::size_t size, int64_t usec) {
     constexpr int steps = 4;
     static std::string suffix[4] = {"B", "KB", "MB", "GB"};
@@ -51,6 +116,75 @@ std::string format_bps(std::size_t size, int64_t usec) {
     return oss.str();
 }
 
+static bool read_line(const std::string &path, std::string &line) {
+    std::ifstream ifs(path);
+    return (bool)std::getline(ifs, line);
+}
+
+// parse cpu list like 0-7,16-23
+static bool parse_cpu_list(const std::string &list, cpu_set_t &set) {
+    std::istringstream iss(list);
+    std::string range;
+
+    CPU_ZERO(&set);
+
+    while (std::getline(iss, range, ',')) {
+        int first, last;
+
+        if (std::sscanf(range.c_str(), "%d-%d", &first, &last) != 2) {
+            if (std::sscanf(range.c_str(), "%d", &first) != 1)
+                return false;
+            last = first;
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &set);
+    }
+
+    return CPU_COUNT(&set) > 0;
+}
+
+int get_iface_numa_node(const std::string &iface) {
+    std::string line;
+
+    if (!read_line("/sys/class/net/" + iface + "/device/numa_node", line))
+        return -1;
+
+    try {
+        return std::stoi(line);
+    }
+    catch (const std::exception &) {
+        return -1;
+    }
+}
+
+int bind_numa_node(int node) {
+    constexpr int MAX_NODES = 1024;
+    constexpr int BITS = sizeof(unsigned long) * 8;
+    unsigned long mask[MAX_NODES / BITS] = {0};
+    std::string line;
+    cpu_set_t set;
+
+    if (node < 0 || node >= MAX_NODES)
+        return EINVAL;
+
+    if (!read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", line))
+        return ENOENT;
+
+    if (!parse_cpu_list(line, set))
+        return EINVAL;
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        return errno;
+
+    // buffers are first touched by threads on this node, prefer its memory
+    mask[node / BITS] = 1UL << (node % BITS);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODES) != 0)
+        return errno;
+
+    return 0;
+}
+
 std::string default_basedir() {
     const char *home = getenv("HOME");
     std::string basedir;
@@ -112,69 +246,42 @@ int create_dirs(const std::string &path, bool remove_filename) {
     return ec.value();
 }
 
-struct LoadState {
-    int max_depth;
-    int max_files;
-    std::set<std::string> unique_path;
-    std::vector<FileDesc> &files;
-};
+int get_file_extents(int fd, uint64_t start, std::size_t max_count,
+                     std::vector<FileExtent> &extents) {
+    constexpr std::size_t BATCH = 256;
+    std::vector<char> buf(sizeof(struct fiemap) + BATCH * sizeof(struct fiemap_extent));
+    struct fiemap *fm = reinterpret_cast<struct fiemap *>(buf.data());
 
-static void load_file(const fs::directory_entry &entry, LoadState &state) {
-    const fs::path &path = entry.path();
-    const char *fn = path.c_str();
+    extents.clear();
 
-    if (access(fn, R_OK) != 0)
-        throw fs::filesystem_error("No read permission", path, std::make_error_code(std::errc::permission_denied));
+    while (max_count == 0 || extents.size() < max_count) {
+        std::size_t count = BATCH;
+        if (max_count > 0)
+            count = std::min(count, max_count - extents.size());
 
-    FileDesc desc {
-        .name = path.filename(),
-        .dir = path.parent_path(),
-        .path = path.string(),
-        .fullpath = fs::canonical(path).string(),
-        .size = entry.file_size()
-    };
+        std::fill(buf.begin(), buf.end(), 0);
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_extent_count = (uint32_t)count;
 
-    if (!state.unique_path.insert(desc.fullpath).second)
-        throw fs::filesystem_error("Duplicate files", path, std::error_code());
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0)
+            return errno;
 
-    FLOG_INFO("FindFile size:%zu path:%s realpath:%s",
-        desc.size, path.c_str(), desc.fullpath.c_str());
-
-    state.files.push_back(std::move(desc));
-}
+        if (fm->fm_mapped_extents == 0)
+            break;
 
-static void load_dir(const fs::directory_entry &dir, LoadState &state, int depth) {
-    const fs::path &path = dir.path();
-    std::error_code ec;
+        bool last = false;
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const struct fiemap_extent &e = fm->fm_extents[i];
 
-    if (depth > state.max_depth)
-        throw fs::filesystem_error("Traversing folders encountered maximum depth", path, ec);
+            extents.push_back(FileExtent{e.fe_logical, e.fe_physical, e.fe_length});
+            start = e.fe_logical + e.fe_length;
+            last = (e.fe_flags & FIEMAP_EXTENT_LAST) != 0;
+        }
 
-    for (auto entry : fs::directory_iterator(path)) {
-        if (entry.is_directory())
-            load_dir(entry, state, depth + 1);
-        else if (entry.is_regular_file())
-            load_file(entry, state);
-        else
-            throw fs::filesystem_error("Unsupported file type", entry.path(), ec);
+        if (last)
+            break;
     }
-}
 
-void load_files(const std::vector<std::string> &paths, std::vector<FileDesc> &files) {
-    LoadState state {
-        .max_depth = 16,
-        .max_files = 65536,
-        .unique_path = {},
-        .files = files
-    };
-
-    for (const std::string &path : paths) {
-        fs::directory_entry e{fs::path(path)};
-        if (e.is_directory())
-            load_dir(e, state, 1);
-        else if (e.is_regular_file())
-            load_file(e, state);
-        else
-            throw fs::filesystem_error("Unsupported file type", fs::path(path), std::error_code());
-    }
+    return 0;
 }
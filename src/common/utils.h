@@ -11,15 +11,40 @@ struct FileDesc {
     std::string dir;
     std::string path;
     std::string fullpath;
+
+    // the directory argument this file is found in, empty for file argument
+    std::string root;
     std::size_t size;
 };
 
 int64_t current_usec();
 
+// wall clock, for timestamps compared across hosts
+int64_t realtime_usec();
+
 std::string format_bps(std::size_t size, int64_t usec);
 
+// `s` as a quoted and escaped json string
+std::string json_quote(const std::string &s);
+
+// split `s` by `sep`, empty items are kept
+std::vector<std::string> split_string(const std::string &s, char sep);
+
+// parse size like 4096, 1.5M or 2G, in powers of 1024
+bool parse_bytes(const std::string &s, std::size_t &size);
+
 bool get_local_addr(std::vector<std::string> &addrs);
 
+// numa utils
+
+// numa node of network interface `iface`, -1 if unknown
+int get_iface_numa_node(const std::string &iface);
+
+// Run the calling thread, and threads it creates later, on the cpus of `node`
+// and prefer memory of `node`. Call it before starting any thread, return 0
+// or errno.
+int bind_numa_node(int node);
+
 // fs utils
 
 // no exception
@@ -31,7 +56,15 @@ int get_abs_path(const std::string &base, const std::string &relative,
                  const std::string &filename, std::string &abs_path);
 int create_dirs(const std::string &path, bool remove_filename);
 
-// may throw exception
-void load_files(const std::vector<std::string> &paths, std::vector<FileDesc> &files);
+struct FileExtent {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+};
+
+// Extents of `fd` from offset `start` by FIEMAP, at most `max_count` of them
+// if not 0. Return 0 or errno, EOPNOTSUPP on file systems without FIEMAP.
+int get_file_extents(int fd, uint64_t start, std::size_t max_count,
+                     std::vector<FileExtent> &extents);
 
 #endif // FCOPY_UTILS_H
@@ -2,6 +2,8 @@
 #include <cstdlib>
 #include <cstdio>
 #include <csignal>
+#include <climits>
+#include <algorithm>
 
 #include <getopt.h>
 #include <unistd.h>
@@ -24,10 +26,24 @@ struct option long_opts[] = {
 };
 
 void signal_handler(int sig) {
-    if (service)
+    if (!service)
+        return;
+
+    if (sig == SIGHUP)
+        service->notify_reload();
+    else
         service->notify();
 }
 
+LinkRateParams get_forward_limit(const FcopyConfig &c) {
+    LinkRateParams p;
+    p.rate = c.fwd_speed_limit;
+    p.burst = c.fwd_speed_burst;
+    p.link_rate = c.fwd_link_speed_limit;
+    p.link_burst = c.fwd_link_speed_burst;
+    return p;
+}
+
 void daemon() {
     int fd;
 
@@ -49,6 +65,22 @@ void daemon() {
 int load_service_config(const std::string &filepath, FcopyConfig &p,
                         std::string &err);
 
+// only the forward speed limits can be changed without restart
+void reload_config() {
+    FcopyConfig new_conf;
+    std::string err;
+
+    if (conf.conffile.empty())
+        return;
+
+    if (load_service_config(conf.conffile, new_conf, err) != 0) {
+        FLOG_ERROR("ReloadConfigFailed %s", err.c_str());
+        return;
+    }
+
+    service->set_forward_limit(get_forward_limit(new_conf));
+}
+
 void usage(const char *name) {
     printf(
         "Usage: %s [OPTION]...\n\n"
@@ -169,17 +201,37 @@ int main(int argc, char *argv[]) {
             printf("StartFailed logfile:%s error:%d\n", conf.logfile.c_str(), ret);
             return ret;
         }
+
+        if (conf.log_buffer_size > 0) {
+            ret = fcopy_start_async_log(conf.log_buffer_size);
+            if (ret != 0)
+                FLOG_WARN("StartAsyncLogFailed error:%d", ret);
+        }
+    }
+
+    int node = conf.numa_node;
+    if (node < 0 && !conf.numa_interface.empty())
+        node = get_iface_numa_node(conf.numa_interface);
+
+    // threads started by coke inherit the binding
+    if (node >= 0) {
+        ret = bind_numa_node(node);
+        if (ret == 0)
+            FLOG_INFO("BindNumaNode node:%d", node);
+        else
+            FLOG_WARN("BindNumaNodeFailed node:%d error:%d", node, ret);
     }
 
     // coke global init
     coke::GlobalSettings settings;
     settings.endpoint_params.max_connections = 2048;
-    settings.poller_threads = 8;
-    settings.handler_threads = 12;
+    settings.poller_threads = std::max(conf.poller_threads, 1);
+    settings.handler_threads = std::max(conf.handler_threads, 1);
     coke::library_init(settings);
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
 
     if (!conf.conffile.empty())
         FLOG_INFO("StartWithConfig %s", conf.conffile.data());
@@ -187,24 +239,66 @@ int main(int argc, char *argv[]) {
     FcopyServiceParams params;
     params.directio = conf.directio;
     params.port = conf.port;
+    params.listeners = std::max(conf.listeners, 1);
+    params.metrics_port = conf.metrics_port;
     params.srv_params.max_connections = conf.srv_max_conn;
     params.srv_params.peer_response_timeout = conf.srv_peer_response_timeout;
     params.srv_params.receive_timeout = conf.srv_receive_timeout;
     params.srv_params.keep_alive_timeout = conf.srv_keep_alive_timeout;
     params.srv_params.request_size_limit = conf.srv_size_limit;
+    params.srv_params.memory_budget = conf.srv_memory_budget;
+    params.srv_params.chunk_pool_size = conf.srv_chunk_pool_size;
     params.cli_params.retry_max = conf.cli_retry_max;
     params.cli_params.send_timeout = conf.cli_send_timeout;
     params.cli_params.receive_timeout = conf.cli_receive_timeout;
     params.cli_params.keep_alive_timeout = conf.cli_keep_alive_timeout;
+    params.cli_params.streams = conf.cli_streams;
+    params.sock_params.send_buffer = (int)std::min<std::size_t>(conf.sock_send_buffer, INT_MAX);
+    params.sock_params.recv_buffer = (int)std::min<std::size_t>(conf.sock_recv_buffer, INT_MAX);
+    params.sock_params.notsent_lowat = (int)std::min<std::size_t>(conf.tcp_notsent_lowat, INT_MAX);
+    params.sock_params.congestion = conf.tcp_congestion;
+    params.receive_mmap = conf.receive_mmap;
+    params.coalesce_params.enable = conf.write_coalesce;
+    params.coalesce_params.buffered_ack = conf.coalesce_buffered_ack;
+    params.coalesce_params.window_size = conf.coalesce_window_size;
+    params.coalesce_params.flush_size = conf.coalesce_flush_size;
+
+    for (const auto &it : conf.sched_classes) {
+        params.disk_sched_params.classes.push_back(it.second);
+        params.net_sched_params.classes.push_back(it.second);
+    }
+
+    params.disk_sched_params.concurrency = conf.sched_disk_concurrency;
+    params.net_sched_params.concurrency = conf.sched_net_concurrency;
+
+    params.fwd_rate_params = get_forward_limit(conf);
 
     params.default_partition = conf.default_partition;
     params.partitions = conf.partitions;
 
+    for (auto &it : params.partitions) {
+        auto pit = conf.partition_policies.find(it.first);
+        if (pit != conf.partition_policies.end())
+            it.second.policy = pit->second;
+    }
+
+    auto pit = conf.partition_policies.find("default");
+    if (pit != conf.partition_policies.end())
+        params.default_policy = pit->second;
+
     service = std::make_unique<FcopyService>(params);
     ret = service->start();
     if (ret == 0) {
         service->wait();
 
+        while (service->take_reload()) {
+            FLOG_INFO("ReloadSignal received");
+            reload_config();
+
+            service->resume();
+            service->wait();
+        }
+
         FLOG_INFO("ExitSignal received");
         service->stop();
     }
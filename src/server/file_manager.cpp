@@ -1,12 +1,19 @@
 #include "server/file_manager.h"
 
 #include <filesystem>
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <sstream>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
 
 namespace fs = std::filesystem;
 
@@ -61,15 +68,31 @@ bool is_subpath(const std::string &base, const std::string &path) {
     return !relative.starts_with("../");
 }
 
-FileManager::FileManager() { }
+FileManager::FileManager(const WriteCoalesceParams &coalesce_params, bool receive_mmap,
+                         std::size_t nshards)
+    : coalesce_params(coalesce_params), receive_mmap(receive_mmap)
+{
+    nshards = std::max<std::size_t>(nshards, 1);
+    for (std::size_t i = 0; i < nshards; i++)
+        shards.emplace_back(std::make_unique<Shard>());
+}
 
 FileManager::~FileManager() {
-    for (auto it : fmap) {
-        const FileInfo &info = it.second;
-        close(info.fd);
+    for (auto &shard : shards) {
+        for (auto &it : shard->fmap) {
+            const FileInfo &info = it.second;
+            close(info.fd);
+        }
     }
 }
 
+FileManager::Shard &
+FileManager::get_shard(const std::string &file_token) const {
+    std::hash<std::string> h;
+
+    return *shards[h(file_token) % shards.size()];
+}
+
 static int create_fd(const char *path, int flag, int mode) {
     int fd = open(path, flag, mode);
     if (fd > 0) {
@@ -82,19 +105,168 @@ static int create_fd(const char *path, int flag, int mode) {
     return -1;
 }
 
+static std::string get_temp_path(const std::string &path, const std::string &token) {
+    fs::path p(path);
+    std::string name = "." + p.filename().string() + ".fcopy-" + token;
+
+    return p.replace_filename(name).string();
+}
+
+static int create_temp_fd(const std::string &path, const std::string &token,
+                          int flag, int mode, std::string &temp_path) {
+#ifdef O_TMPFILE
+    std::string dir = fs::path(path).parent_path().string();
+    int fd = open(dir.c_str(), (flag & ~O_CREAT) | O_TMPFILE, mode);
+
+    if (fd >= 0) {
+        temp_path.clear();
+        return fd;
+    }
+
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+        return -1;
+#endif
+
+    // the file system does not support O_TMPFILE, use a hidden temp file
+    temp_path = get_temp_path(path, token);
+    return create_fd(temp_path.c_str(), flag, mode);
+}
+
+// make a rename or link in the directory of `path` durable
+static int sync_parent_dir(const std::string &path) {
+    std::string dir = fs::path(path).parent_path().string();
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    int error = 0;
+
+    if (fd < 0)
+        return errno;
+
+    if (fsync(fd) != 0)
+        error = errno;
+
+    close(fd);
+    return error;
+}
+
+static int publish_file(const FileInfo &info) {
+    std::string temp_path = info.temp_path;
+
+    if (fdatasync(info.fd) != 0)
+        return errno;
+
+    if (temp_path.empty()) {
+        std::string proc_path = "/proc/self/fd/" + std::to_string(info.fd);
+
+        temp_path = get_temp_path(info.file_path, info.file_token);
+        if (linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, temp_path.c_str(),
+                   AT_SYMLINK_FOLLOW) != 0)
+            return errno;
+    }
+
+    if (rename(temp_path.c_str(), info.file_path.c_str()) != 0) {
+        int error = errno;
+        unlink(temp_path.c_str());
+        return error;
+    }
+
+    return sync_parent_dir(info.file_path);
+}
+
+static fs::path normal_dir(const std::string &path) {
+    fs::path p = fs::path(path).lexically_normal();
+
+    if (!p.has_filename())
+        p = p.parent_path();
+
+    return p;
+}
+
+static fs::path get_stage_dir(const fs::path &dir) {
+    std::string name = "." + dir.filename().string() + ".fcopy-stage";
+
+    return dir.parent_path() / name;
+}
+
+static int exchange_dir(const fs::path &stage, const fs::path &dir) {
+    std::error_code ec;
+
+    if (!fs::exists(dir, ec)) {
+        if (rename(stage.c_str(), dir.c_str()) != 0)
+            return errno;
+        return 0;
+    }
+
+#ifdef SYS_renameat2
+    if (syscall(SYS_renameat2, AT_FDCWD, stage.c_str(), AT_FDCWD, dir.c_str(),
+                RENAME_EXCHANGE) == 0) {
+        // the old tree is in stage now
+        fs::remove_all(stage, ec);
+        return 0;
+    }
+
+    if (errno != ENOSYS && errno != EINVAL)
+        return errno;
+#endif
+
+    // no atomic exchange, move the old tree away first
+    fs::path old = stage;
+    old += ".old";
+
+    if (rename(dir.c_str(), old.c_str()) != 0)
+        return errno;
+
+    if (rename(stage.c_str(), dir.c_str()) != 0) {
+        int error = errno;
+        rename(old.c_str(), dir.c_str());
+        return error;
+    }
+
+    fs::remove_all(old, ec);
+    return 0;
+}
+
+static std::shared_ptr<char> map_file(int fd, std::size_t size) {
+    struct stat st;
+    void *p;
+
+    // allocate blocks first, writing to a hole of a full disk through the
+    // mapping raises SIGBUS instead of returning ENOSPC. Some file systems
+    // accept fallocate without reserving the blocks, check them too, any
+    // failure falls back to pwrite
+    if (fallocate(fd, 0, 0, size) != 0)
+        return nullptr;
+
+    if (fstat(fd, &st) != 0 || (std::size_t)st.st_blocks * 512 < size)
+        return nullptr;
+
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    return std::shared_ptr<char>(static_cast<char *>(p), [size](char *p) {
+        munmap(p, size);
+    });
+}
+
 constexpr std::size_t PAGE_SIZE = 8 * 1024;
 int FileManager::create_file(const std::string &name, std::size_t size,
-                             std::size_t chunk_size, bool directio,
-                             std::string &file_token)
+                             std::size_t chunk_size,
+                             const std::shared_ptr<PartitionIo> &part, bool atomic,
+                             int sched_class, std::string &file_token)
 {
+    bool directio = part->use_directio();
+    bool null_sink = part->is_null_sink();
     std::string path = get_full_path(name);
     std::string token = get_token(path);
+    std::string temp_path;
     int fd = -1;
     int oflag = O_CREAT | O_RDWR;
     int mode = 0660;
 
     if (directio)
         oflag |= O_DIRECT;
+    if (part->get_sync_mode() == PARTITION_SYNC_WRITE)
+        oflag |= O_DSYNC;
 
     auto return_error = [&] (int ret, int error, const char *type) mutable {
         file_token.assign("Error: ").append(type)
@@ -109,10 +281,17 @@ int FileManager::create_file(const std::string &name, std::size_t size,
     if (chunk_size == 0 || chunk_size % PAGE_SIZE != 0)
         return return_error(-EINVAL, EINVAL, "chunk_size");
 
-    if (!create_directories(path))
+    if (null_sink) {
+        // chunks are not written, the fd only marks the file as opened
+        atomic = false;
+        fd = open("/dev/null", O_WRONLY);
+    }
+    else if (!create_directories(path))
         return return_error(-ENOTDIR, ENOTDIR, "create_directory");
-
-    fd = create_fd(path.c_str(), oflag, mode);
+    else if (atomic)
+        fd = create_temp_fd(path, token, oflag, mode, temp_path);
+    else
+        fd = create_fd(path.c_str(), oflag, mode);
 
     if (fd < 0)
         return return_error(-errno, errno, "create_file");
@@ -123,58 +302,264 @@ int FileManager::create_file(const std::string &name, std::size_t size,
     info.file_name = name;
     info.file_path = path;
     info.file_token = token;
-
-    std::lock_guard<std::mutex> lg(this->mtx);
-    auto it = fmap.find(token);
-    if (it != fmap.end())
+    info.atomic = atomic;
+    info.temp_path = temp_path;
+    info.sched_class = sched_class;
+    info.part = part;
+
+    if (coalesce_params.enable && !null_sink)
+        info.coalescer = std::make_shared<WriteCoalescer>(fd, part, coalesce_params);
+
+    // chunks received into the mapping skip the partition limits and the
+    // O_DSYNC of sync=write. Map here, not in the poller thread by the first
+    // chunk; if it fails chunks fall back to buffers and pwrite
+    if (receive_mmap && !directio && !null_sink && size > 0 && !info.coalescer &&
+        !part->is_bounded() && part->get_sync_mode() != PARTITION_SYNC_WRITE)
+        info.map = map_file(fd, size);
+
+    Shard &shard = get_shard(token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    auto it = shard.fmap.find(token);
+    if (it != shard.fmap.end())
         return return_error(-EEXIST, EEXIST, "duplicate_token");
 
     file_token = token;
-    fmap.emplace(token, info);
+    shard.fmap.emplace(token, info);
 
     return 0;
 }
 
 int FileManager::close_file(const std::string &file_token) {
     FileInfo info;
+    int error = 0;
     {
-        std::lock_guard<std::mutex> lg(this->mtx);
-        auto it = fmap.find(file_token);
-        if (it == fmap.end())
+        Shard &shard = get_shard(file_token);
+        std::lock_guard<std::mutex> lg(shard.mtx);
+        auto it = shard.fmap.find(file_token);
+        if (it == shard.fmap.end())
             return -ENOENT;
 
-        info = it->second;
-        fmap.erase(it);
+        info = std::move(it->second);
+        shard.fmap.erase(it);
     }
 
+    if (info.coalescer)
+        error = info.coalescer->flush_all();
+
+    if (info.part && info.part->is_null_sink()) {
+        close(info.fd);
+        return 0;
+    }
+
+    // chunks still being received keep the mapping
+    info.map.reset();
     ftruncate(info.fd, info.total_size);
+
+    // published files are synchronized anyway
+    if (error == 0 && !info.atomic && info.part &&
+        info.part->get_sync_mode() == PARTITION_SYNC_CLOSE)
+    {
+        if (fdatasync(info.fd) != 0)
+            error = errno;
+    }
+
+    if (info.atomic) {
+        if (error == 0)
+            error = publish_file(info);
+        else if (!info.temp_path.empty())
+            unlink(info.temp_path.c_str());
+    }
+
+    close(info.fd);
+    return -error;
+}
+
+int FileManager::delete_file(const std::string &file_token) {
+    FileInfo info;
+    std::string path;
+    {
+        Shard &shard = get_shard(file_token);
+        std::lock_guard<std::mutex> lg(shard.mtx);
+        auto it = shard.fmap.find(file_token);
+        if (it == shard.fmap.end())
+            return -ENOENT;
+
+        info = std::move(it->second);
+        shard.fmap.erase(it);
+    }
+
+    // wake up the waiters of buffered chunks
+    if (info.coalescer)
+        info.coalescer->flush_all();
+
     close(info.fd);
+    if (info.part && info.part->is_null_sink())
+        return 0;
+
+    // an O_TMPFILE disappears after closed
+    path = info.atomic ? info.temp_path : info.file_path;
+    if (!path.empty() && unlink(path.c_str()) != 0)
+        return -errno;
+
     return 0;
 }
 
-int FileManager::set_chain_targets(const std::string &file_token, const std::vector<ChainTarget> &targets) {
-    std::lock_guard<std::mutex> lg(this->mtx);
-    auto it = fmap.find(file_token);
-    if (it == fmap.end())
+int FileManager::set_chain_targets(const std::string &file_token, const std::vector<ChainTarget> &targets,
+                                   const std::vector<RemoteTarget> &remotes) {
+    Shard &shard = get_shard(file_token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    auto it = shard.fmap.find(file_token);
+    if (it == shard.fmap.end())
         return -1;
 
     it->second.targets = targets;
+    it->second.remotes = remotes;
     return 0;
 }
 
 bool FileManager::has_file(const std::string &file_token) const {
-    std::lock_guard<std::mutex> lg(this->mtx);
-    return fmap.contains(file_token);
+    Shard &shard = get_shard(file_token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    return shard.fmap.contains(file_token);
 }
 
-int FileManager::get_fd(const std::string &file_token, std::vector<ChainTarget> &targets) {
-    std::lock_guard<std::mutex> lg(this->mtx);
-    auto it = fmap.find(file_token);
-    if (it == fmap.end())
+int FileManager::get_fd(const std::string &file_token, FileRef &ref) {
+    Shard &shard = get_shard(file_token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    auto it = shard.fmap.find(file_token);
+    if (it == shard.fmap.end())
         return -1;
 
-    targets = it->second.targets;
-    return it->second.fd;
+    const FileInfo &info = it->second;
+    ref.fd = info.fd;
+    ref.sched_class = info.sched_class;
+    ref.part = info.part;
+    ref.targets = info.targets;
+    ref.remotes = info.remotes;
+    ref.coalescer = info.coalescer;
+    return info.fd;
+}
+
+std::shared_ptr<char> FileManager::get_sink(const std::string &file_token,
+                                            uint64_t offset, std::size_t size) {
+    Shard &shard = get_shard(file_token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    auto it = shard.fmap.find(file_token);
+    if (it == shard.fmap.end())
+        return nullptr;
+
+    // chunks of files in chain are forwarded and need their own buffers
+    FileInfo &info = it->second;
+    if (!info.map || !info.targets.empty())
+        return nullptr;
+
+    if (offset > info.total_size || size > info.total_size - offset)
+        return nullptr;
+
+    return std::shared_ptr<char>(info.map, info.map.get() + offset);
+}
+
+// bound the memory of a file whose client never fetches its spans
+constexpr std::size_t MAX_FILE_SPANS = 64 * 1024;
+
+void FileManager::add_spans(const std::string &file_token, std::vector<TraceSpan> &spans) {
+    Shard &shard = get_shard(file_token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    auto it = shard.fmap.find(file_token);
+    if (it == shard.fmap.end())
+        return;
+
+    std::vector<TraceSpan> &to = it->second.spans;
+    for (TraceSpan &s : spans) {
+        if (to.size() >= MAX_FILE_SPANS)
+            break;
+        to.push_back(std::move(s));
+    }
+}
+
+int FileManager::take_spans(const std::string &file_token, std::vector<TraceSpan> &spans) {
+    Shard &shard = get_shard(file_token);
+    std::lock_guard<std::mutex> lg(shard.mtx);
+    auto it = shard.fmap.find(file_token);
+    if (it == shard.fmap.end())
+        return -ENOENT;
+
+    spans.swap(it->second.spans);
+    it->second.spans.clear();
+    return 0;
+}
+
+int FileManager::get_stage_path(const std::string &commit_path, const std::string &path,
+                                std::string &stage_path, std::string &old_stage) {
+    fs::path dir = normal_dir(commit_path);
+    fs::path rel = fs::path(path).lexically_normal().lexically_relative(dir);
+    fs::path stage = get_stage_dir(dir);
+    std::error_code ec;
+
+    if (rel.empty() || *rel.begin() == "..")
+        return -EINVAL;
+
+    std::lock_guard<std::mutex> lg(this->mtx);
+    if (!stages.contains(dir.string())) {
+        // move away what the last failed job left, the caller removes it
+        fs::path old = stage;
+        old += ".stale." + std::to_string(++stale_seq);
+
+        if (rename(stage.c_str(), old.c_str()) == 0)
+            old_stage = old.string();
+        else if (errno != ENOENT)
+            return -errno;
+
+        fs::create_directories(stage, ec);
+        if (ec)
+            return -ec.value();
+
+        stages.insert(dir.string());
+    }
+
+    stage_path = (stage / rel).string();
+    return 0;
+}
+
+void FileManager::remove_stage(const std::string &old_stage) {
+    std::error_code ec;
+
+    fs::remove_all(old_stage, ec);
+}
+
+int FileManager::commit_dir(const std::string &commit_path, bool discard) {
+    fs::path dir = normal_dir(commit_path);
+    fs::path stage = get_stage_dir(dir);
+    std::string prefix = stage.string() + "/";
+    std::error_code ec;
+
+    {
+        std::lock_guard<std::mutex> lg(this->mtx);
+        if (!stages.contains(dir.string()))
+            return -ENOENT;
+
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> slg(shard->mtx);
+
+            for (const auto &it : shard->fmap) {
+                if (it.second.file_path.starts_with(prefix))
+                    return -EBUSY;
+            }
+        }
+
+        stages.erase(dir.string());
+    }
+
+    if (discard) {
+        fs::remove_all(stage, ec);
+        return -ec.value();
+    }
+
+    int error = exchange_dir(stage, dir);
+    if (error == 0)
+        error = sync_parent_dir(dir.string());
+
+    return -error;
 }
 
 int FileManager::set_range(const std::string &file_token,
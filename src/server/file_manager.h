@@ -6,8 +6,13 @@
 #include <mutex>
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
 
 #include "common/structures.h"
+#include "common/co_fcopy.h"
+#include "server/write_coalescer.h"
+#include "server/partition_io.h"
 
 struct FileInfo {
     int fd;
@@ -17,31 +22,95 @@ struct FileInfo {
     std::string file_path;
     std::string file_token;
 
+    // atomic publish, the file is written to temp_path, or to an O_TMPFILE if
+    // temp_path is empty, and renamed to file_path when closed
+    bool atomic;
+    std::string temp_path;
+
+    int sched_class;
+    std::shared_ptr<PartitionIo> part;
+
+    // leaf files in buffered mode may be received into a shared mapping of
+    // the whole file, created when the file is opened
+    std::shared_ptr<char> map;
+
     std::vector<ChainTarget> targets;
+    // targets with resolved address, in the same order
+    std::vector<RemoteTarget> remotes;
+    std::shared_ptr<WriteCoalescer> coalescer;
+
+    // spans of sampled chunks, until fetched by the client
+    std::vector<TraceSpan> spans;
+};
+
+// what handling a chunk of an opened file needs
+struct FileRef {
+    int fd;
+    int sched_class;
+    std::shared_ptr<PartitionIo> part;
+
+    std::vector<ChainTarget> targets;
+    // targets with resolved address, in the same order
+    std::vector<RemoteTarget> remotes;
+    std::shared_ptr<WriteCoalescer> coalescer;
 };
 
 class FileManager {
 private:
+    // opened files are spread over shards by token, so that requests of
+    // different files seldom contend for one lock
+    struct Shard {
+        std::map<std::string, FileInfo> fmap;
+        mutable std::mutex mtx;
+    };
+
     static std::string get_full_path(const std::string &name);
     static std::string get_token(const std::string &path);
 
+    Shard &get_shard(const std::string &file_token) const;
+
 public:
-    FileManager();
+    FileManager(const WriteCoalesceParams &coalesce_params, bool receive_mmap = false,
+                std::size_t nshards = 1);
     FileManager(const FileManager &) = delete;
     ~FileManager();
 
-    int create_file(const std::string &name, std::size_t size,
-                    std::size_t chunk_size, bool directio, std::string &file_token);
+    // the file is opened with the policy of `part`
+    int create_file(const std::string &name, std::size_t size, std::size_t chunk_size,
+                    const std::shared_ptr<PartitionIo> &part, bool atomic,
+                    int sched_class, std::string &file_token);
     int close_file(const std::string &file_token);
-    int set_chain_targets(const std::string &file_token, const std::vector<ChainTarget> &targets);
+    int delete_file(const std::string &file_token);
+    int set_chain_targets(const std::string &file_token, const std::vector<ChainTarget> &targets,
+                          const std::vector<RemoteTarget> &remotes);
     bool has_file(const std::string &file_token) const;
 
-    int get_fd(const std::string &file_token, std::vector<ChainTarget> &targets);
+    int get_fd(const std::string &file_token, FileRef &ref);
+
+    // the data sink of SendFileReq, see fcopy_set_data_sink
+    std::shared_ptr<char> get_sink(const std::string &file_token,
+                                   uint64_t offset, std::size_t size);
     int set_range(const std::string &file_token, long offset, long length);
 
+    void add_spans(const std::string &file_token, std::vector<TraceSpan> &spans);
+    int take_spans(const std::string &file_token, std::vector<TraceSpan> &spans);
+
+    // map `path` under `commit_path` into the stage dir of `commit_path`, a
+    // stage left by a failed job is moved to `old_stage`, see remove_stage
+    int get_stage_path(const std::string &commit_path, const std::string &path,
+                       std::string &stage_path, std::string &old_stage);
+    // the tree may be large, do not call it in handler threads
+    static void remove_stage(const std::string &old_stage);
+    int commit_dir(const std::string &commit_path, bool discard);
+
 private:
-    std::map<std::string, FileInfo> fmap;
+    WriteCoalesceParams coalesce_params;
+    bool receive_mmap;
+
+    std::vector<std::unique_ptr<Shard>> shards;
     std::map<std::string, std::string> token_map;  // filepath -> token
+    std::set<std::string> stages;   // commit paths being staged
+    uint64_t stale_seq{0};
     mutable std::mutex mtx;
 };
 
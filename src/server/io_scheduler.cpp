@@ -0,0 +1,142 @@
+#include "server/io_scheduler.h"
+
+#include <algorithm>
+
+#include "coke/sleep.h"
+#include "common/utils.h"
+
+IoScheduler::IoScheduler(const IoSchedulerParams &params)
+    : concurrency(std::max(params.concurrency, 1))
+{
+    ClassState def;
+    def.conf = SchedClass{"default", 1, 0};
+    classes.push_back(std::move(def));
+
+    for (const SchedClass &conf : params.classes) {
+        ClassState st;
+        st.conf = conf;
+        if (st.conf.weight == 0)
+            st.conf.weight = 1;
+
+        if (conf.name == "default")
+            classes[0] = std::move(st);
+        else
+            classes.push_back(std::move(st));
+    }
+}
+
+int IoScheduler::get_class(const std::string &name) const {
+    for (std::size_t i = 0; i < classes.size(); i++) {
+        if (classes[i].conf.name == name)
+            return (int)i;
+    }
+
+    return 0;
+}
+
+int64_t IoScheduler::pace(ClassState &st, std::size_t size) {
+    int64_t now, start;
+
+    if (st.conf.rate_limit == 0)
+        return 0;
+
+    now = current_usec();
+    start = std::max(now, st.next_usec);
+    st.next_usec = start + (int64_t)(size * 1.0e6 / st.conf.rate_limit);
+
+    return start - now;
+}
+
+coke::Task<> IoScheduler::acquire(int cls, std::size_t size) {
+    coke::Latch latch(1);
+    int64_t delay;
+
+    if (cls < 0 || cls >= (int)classes.size())
+        cls = 0;
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        delay = pace(classes[cls], size);
+    }
+
+    if (delay > 0)
+        co_await coke::sleep(std::chrono::microseconds(delay));
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        ClassState &st = classes[cls];
+        double start_tag = std::max(vtime, st.last_finish);
+
+        st.last_finish = start_tag + (double)size / st.conf.weight;
+
+        if (running < concurrency) {
+            running++;
+            vtime = start_tag;
+            co_return;
+        }
+
+        st.waiters.push_back(Waiter{start_tag, &latch});
+    }
+
+    co_await latch.wait();
+}
+
+coke::Task<> IoScheduler::acquire_urgent() {
+    coke::Latch latch(1);
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        if (running < concurrency) {
+            running++;
+            co_return;
+        }
+
+        urgent.push_back(&latch);
+    }
+
+    co_await latch.wait();
+}
+
+std::size_t IoScheduler::get_waiting() {
+    std::lock_guard<std::mutex> lg(mtx);
+    std::size_t n = urgent.size();
+
+    for (const ClassState &st : classes)
+        n += st.waiters.size();
+
+    return n;
+}
+
+void IoScheduler::release() {
+    coke::Latch *latch = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        ClassState *next = nullptr;
+
+        for (ClassState &st : classes) {
+            if (st.waiters.empty())
+                continue;
+
+            if (!next || st.waiters.front().start_tag < next->waiters.front().start_tag)
+                next = &st;
+        }
+
+        if (!urgent.empty()) {
+            // urgent operations go first and do not advance virtual time
+            latch = urgent.front();
+            urgent.pop_front();
+        }
+        else if (next) {
+            // pass the slot to the waiter with the smallest start tag
+            vtime = next->waiters.front().start_tag;
+            latch = next->waiters.front().latch;
+            next->waiters.pop_front();
+        }
+        else
+            running--;
+    }
+
+    if (latch)
+        latch->count_down();
+}
@@ -0,0 +1,70 @@
+#ifndef FCOPY_IO_SCHEDULER_H
+#define FCOPY_IO_SCHEDULER_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "coke/global.h"
+#include "coke/latch.h"
+#include "common/structures.h"
+
+struct IoSchedulerParams {
+    // max operations running at the same time
+    int concurrency = 4;
+
+    // files without a known class use the class named default
+    std::vector<SchedClass> classes;
+};
+
+// IoScheduler arbitrates chunk operations of different classes with start-time
+// fair queueing, each class gets slots in proportion to its weight. A class
+// with rate_limit is paced before it enters the queue.
+class IoScheduler {
+    struct Waiter {
+        double start_tag;
+        coke::Latch *latch;
+    };
+
+    struct ClassState {
+        SchedClass conf;
+        double last_finish = 0;
+        int64_t next_usec = 0;
+        std::deque<Waiter> waiters;
+    };
+
+public:
+    IoScheduler(const IoSchedulerParams &params);
+    IoScheduler(const IoScheduler &) = delete;
+
+    // return the index of class `name`, or 0 for the default class
+    int get_class(const std::string &name) const;
+
+    // wait until an operation of `size` bytes in class `cls` may run, and
+    // call release after the operation is done
+    coke::Task<> acquire(int cls, std::size_t size);
+    void release();
+
+    // like acquire, but run before all queued operations, for control
+    // requests which the client is waiting for, e.g. closing a file
+    coke::Task<> acquire_urgent();
+
+    // operations waiting for a slot
+    std::size_t get_waiting();
+
+private:
+    int64_t pace(ClassState &st, std::size_t size);
+
+private:
+    int concurrency;
+    int running{0};
+    double vtime{0};
+
+    std::mutex mtx;
+    std::vector<ClassState> classes;
+    std::deque<coke::Latch *> urgent;
+};
+
+#endif // FCOPY_IO_SCHEDULER_H
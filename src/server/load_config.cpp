@@ -186,7 +186,91 @@ parse_partition(std::map<std::string, FsPartition> *p, const std::vector<std::st
     if (p == nullptr || args.size() != 2)
         return -1;
 
-    p->insert({args[0], FsPartition{args[0], args[1]}});
+    p->insert({args[0], FsPartition{args[0], args[1], PartitionPolicy()}});
+    return 0;
+}
+
+static int
+parse_sched_class(std::map<std::string, SchedClass> *p, const std::vector<std::string> &args) {
+    SchedClass c{"", 1, 0};
+    std::vector<std::string> arg;
+
+    if (p == nullptr || args.size() < 2 || args.size() > 3)
+        return -1;
+
+    c.name = args[0];
+
+    arg.assign(1, args[1]);
+    if (parse_unsigned<unsigned>(&c.weight, arg) < 0 || c.weight == 0)
+        return -1;
+
+    if (args.size() == 3) {
+        arg.assign(1, args[2]);
+        if (parse_size(&c.rate_limit, arg) < 0)
+            return -1;
+    }
+
+    (*p)[c.name] = c;
+    return 0;
+}
+
+static int
+parse_partition_policy(std::map<std::string, PartitionPolicy> *p,
+                       const std::vector<std::string> &args) {
+    PartitionPolicy policy;
+    std::vector<std::string> arg;
+    std::string key, value;
+    bool flag;
+    int ret;
+
+    if (p == nullptr || args.size() < 1)
+        return -1;
+
+    // name key=value ...
+    for (std::size_t i = 1; i < args.size(); i++) {
+        std::size_t pos = args[i].find('=');
+        if (pos == std::string::npos)
+            return -1;
+
+        key = args[i].substr(0, pos);
+        value = args[i].substr(pos + 1);
+        arg.assign(1, value);
+
+        if (key == "directio") {
+            ret = parse_bool(&flag, arg);
+            policy.directio = flag ? 1 : 0;
+        }
+        else if (key == "engine") {
+            ret = (value == "aio" || value == "sync") ? 0 : -1;
+            policy.sync_engine = (value == "sync");
+        }
+        else if (key == "queue-depth")
+            ret = parse_signed<int>(&policy.queue_depth, arg);
+        else if (key == "sync") {
+            ret = 0;
+            if (value == "none")
+                policy.sync_mode = PARTITION_SYNC_NONE;
+            else if (value == "close")
+                policy.sync_mode = PARTITION_SYNC_CLOSE;
+            else if (value == "write")
+                policy.sync_mode = PARTITION_SYNC_WRITE;
+            else
+                ret = -1;
+        }
+        else if (key == "rate-limit")
+            ret = parse_size(&policy.rate_limit, arg);
+        else if (key == "sink") {
+            ret = (value == "file" || value == "null") ? 0 : -1;
+            policy.null_sink = (value == "null");
+        }
+        else
+            ret = -1;
+
+        if (ret < 0 || policy.queue_depth < 0)
+            return -1;
+    }
+
+    (*p)[args[0]] = policy;
     return 0;
 }
 
@@ -217,8 +301,16 @@ int load_service_config(const std::string &filepath, FcopyConfig &p,
 
     bool_map.emplace("daemonize", &p.daemonize);
     bool_map.emplace("directio", &p.directio);
+    bool_map.emplace("receive-mmap", &p.receive_mmap);
+    bool_map.emplace("write-coalesce", &p.write_coalesce);
+    bool_map.emplace("coalesce-buffered-ack", &p.coalesce_buffered_ack);
 
     int_map.emplace("port", &p.port);
+    int_map.emplace("listeners", &p.listeners);
+    int_map.emplace("metrics-port", &p.metrics_port);
+    int_map.emplace("poller-threads", &p.poller_threads);
+    int_map.emplace("handler-threads", &p.handler_threads);
+    int_map.emplace("numa-node", &p.numa_node);
     int_map.emplace("srv_max_conn", &p.srv_max_conn);
     int_map.emplace("srv-peer-response-timeout", &p.srv_peer_response_timeout);
     int_map.emplace("srv-receive-timeout", &p.srv_receive_timeout);
@@ -227,13 +319,30 @@ int load_service_config(const std::string &filepath, FcopyConfig &p,
     int_map.emplace("cli-send-timeout", &p.cli_send_timeout);
     int_map.emplace("cli-receive-timeout", &p.cli_receive_timeout);
     int_map.emplace("cli-keep-alive-timeout", &p.cli_keep_alive_timeout);
+    int_map.emplace("cli-streams", &p.cli_streams);
+    int_map.emplace("sched-disk-concurrency", &p.sched_disk_concurrency);
+    int_map.emplace("sched-net-concurrency", &p.sched_net_concurrency);
 
     cap_map.emplace("request-size-limit", &p.srv_size_limit);
+    cap_map.emplace("srv-memory-budget", &p.srv_memory_budget);
+    cap_map.emplace("srv-chunk-pool-size", &p.srv_chunk_pool_size);
+    cap_map.emplace("coalesce-window-size", &p.coalesce_window_size);
+    cap_map.emplace("coalesce-flush-size", &p.coalesce_flush_size);
+    cap_map.emplace("forward-speed-limit", &p.fwd_speed_limit);
+    cap_map.emplace("forward-speed-burst", &p.fwd_speed_burst);
+    cap_map.emplace("forward-link-speed-limit", &p.fwd_link_speed_limit);
+    cap_map.emplace("forward-link-speed-burst", &p.fwd_link_speed_burst);
+    cap_map.emplace("socket-send-buffer", &p.sock_send_buffer);
+    cap_map.emplace("socket-recv-buffer", &p.sock_recv_buffer);
+    cap_map.emplace("tcp-notsent-lowat", &p.tcp_notsent_lowat);
+    cap_map.emplace("log-buffer-size", &p.log_buffer_size);
 
     str_map.emplace("logfile", &p.logfile);
     str_map.emplace("pidfile", &p.pidfile);
     str_map.emplace("basedir", &p.basedir);
     str_map.emplace("default-partition", &p.default_partition);
+    str_map.emplace("tcp-congestion", &p.tcp_congestion);
+    str_map.emplace("numa-interface", &p.numa_interface);
 
     while (std::getline(ifs, line)) {
         ret = parse_line(line, key, args);
@@ -259,6 +368,10 @@ int load_service_config(const std::string &filepath, FcopyConfig &p,
             ret = parse_bool(bool_it->second, args);
         else if (key == "partitions")
             ret = parse_partition(&p.partitions, args);
+        else if (key == "partition-policy")
+            ret = parse_partition_policy(&p.partition_policies, args);
+        else if (key == "sched-class")
+            ret = parse_sched_class(&p.sched_classes, args);
         else
             ret = 0;
 
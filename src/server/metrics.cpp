@@ -0,0 +1,93 @@
+#include "server/metrics.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <vector>
+
+void ServerMetrics::add_error(int error) {
+    std::lock_guard<std::mutex> lg(err_mtx);
+    errors[error]++;
+}
+
+static void append_line(std::string &out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append_line(std::string &out, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        out.append(buf, std::min<std::size_t>(n, sizeof(buf) - 1));
+}
+
+static void append_counter(std::string &out, const char *name, uint64_t value) {
+    append_line(out, "# TYPE %s counter\n%s %llu\n", name, name,
+                (unsigned long long)value);
+}
+
+static void append_gauge(std::string &out, const char *name, int64_t value) {
+    append_line(out, "# TYPE %s gauge\n%s %lld\n", name, name, (long long)value);
+}
+
+// export with buckets of powers of two, from 16us to about 67s, the fine
+// buckets never cross a power of two
+static void append_histogram(std::string &out, const char *name, const Histogram &h) {
+    std::vector<uint64_t> counts(Histogram::BUCKETS);
+    uint64_t sum, cum = 0;
+    int i = 0;
+
+    h.snapshot(counts.data(), sum);
+    append_line(out, "# TYPE %s histogram\n", name);
+
+    for (int k = 4; k <= 26; k++) {
+        uint64_t le = 1ULL << k;
+
+        while (i < Histogram::BUCKETS && Histogram::bucket_max(i) < le)
+            cum += counts[i++];
+
+        append_line(out, "%s_bucket{le=\"%g\"} %llu\n", name, le / 1.0e6,
+                    (unsigned long long)cum);
+    }
+
+    while (i < Histogram::BUCKETS)
+        cum += counts[i++];
+
+    append_line(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cum);
+    append_line(out, "%s_sum %g\n", name, sum / 1.0e6);
+    append_line(out, "%s_count %llu\n", name, (unsigned long long)cum);
+}
+
+std::string ServerMetrics::to_prometheus(const std::map<std::string, int64_t> &gauges) const {
+    std::string out;
+
+    append_counter(out, "fcopy_received_bytes_total", received_bytes.value());
+    append_counter(out, "fcopy_written_bytes_total", written_bytes.value());
+    append_counter(out, "fcopy_discarded_bytes_total", discarded_bytes.value());
+    append_counter(out, "fcopy_forwarded_bytes_total", forwarded_bytes.value());
+    append_counter(out, "fcopy_chunks_total", chunks.value());
+
+    append_histogram(out, "fcopy_chunk_receive_seconds", receive_latency);
+    append_histogram(out, "fcopy_chunk_write_seconds", write_latency);
+    append_histogram(out, "fcopy_chunk_forward_seconds", forward_latency);
+
+    append_gauge(out, "fcopy_open_files", open_files.load(std::memory_order_relaxed));
+    append_gauge(out, "fcopy_inflight_chunks", inflight_chunks.load(std::memory_order_relaxed));
+
+    for (const auto &it : gauges)
+        append_gauge(out, it.first.c_str(), it.second);
+
+    std::lock_guard<std::mutex> lg(err_mtx);
+    out.append("# TYPE fcopy_errors_total counter\n");
+    for (const auto &it : errors) {
+        append_line(out, "fcopy_errors_total{code=\"%d\"} %llu\n", it.first,
+                    (unsigned long long)it.second);
+    }
+
+    return out;
+}
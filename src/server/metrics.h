@@ -0,0 +1,41 @@
+#ifndef FCOPY_SERVER_METRICS_H
+#define FCOPY_SERVER_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "common/metrics.h"
+
+// ServerMetrics is the registry of fcopy server, exported in the text format
+// of prometheus by the metrics listener and STATS command.
+struct ServerMetrics {
+    Counter received_bytes;
+    Counter written_bytes;
+    // received by null sink partitions and not written
+    Counter discarded_bytes;
+    Counter forwarded_bytes;
+    Counter chunks;
+
+    // phases of a chunk, from the first byte received to handler, writing
+    // to disk, and waiting the acks of the next servers
+    Histogram receive_latency;
+    Histogram write_latency;
+    Histogram forward_latency;
+
+    std::atomic<int64_t> open_files{0};
+    std::atomic<int64_t> inflight_chunks{0};
+
+    void add_error(int error);
+
+    // `gauges` are read from other modules by the caller, by metric name
+    std::string to_prometheus(const std::map<std::string, int64_t> &gauges) const;
+
+private:
+    mutable std::mutex err_mtx;
+    std::map<int, uint64_t> errors;
+};
+
+#endif // FCOPY_SERVER_METRICS_H
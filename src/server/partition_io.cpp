@@ -0,0 +1,122 @@
+#include "server/partition_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "coke/go.h"
+#include "coke/sleep.h"
+#include "common/utils.h"
+
+PartitionIo::PartitionIo(const std::string &name, const PartitionPolicy &policy,
+                         bool directio, Histogram *write_latency)
+    : name(name), queue("io-" + name), policy(policy), write_latency(write_latency)
+{
+    this->directio = policy.directio < 0 ? directio : (policy.directio != 0);
+    if (policy.null_sink)
+        this->directio = false;
+
+    if (policy.queue_depth > 0)
+        sem = std::make_unique<coke::Semaphore>(policy.queue_depth);
+}
+
+coke::Task<> PartitionIo::acquire(std::size_t size) {
+    int64_t delay = 0;
+
+    if (policy.rate_limit > 0 && size > 0) {
+        std::lock_guard<std::mutex> lg(mtx);
+        int64_t now = current_usec();
+        int64_t start = std::max(now, next_usec);
+
+        next_usec = start + (int64_t)(size * 1.0e6 / policy.rate_limit);
+        delay = start - now;
+    }
+
+    if (delay > 0)
+        co_await coke::sleep(std::chrono::microseconds(delay));
+
+    if (sem)
+        co_await sem->acquire();
+}
+
+void PartitionIo::release() {
+    if (sem)
+        sem->release();
+}
+
+coke::Task<> PartitionIo::switch_thread() {
+    co_await coke::switch_go_thread(queue);
+}
+
+static coke::FileResult to_result(ssize_t ret) {
+    coke::FileResult res;
+
+    if (ret < 0) {
+        res.state = coke::STATE_SYS_ERROR;
+        res.error = errno;
+        res.nbytes = 0;
+    }
+    else {
+        res.state = coke::STATE_SUCCESS;
+        res.error = 0;
+        res.nbytes = ret;
+    }
+
+    return res;
+}
+
+void PartitionIo::record(TraceSpan *span, int64_t start) {
+    int64_t cost = current_usec() - start;
+
+    if (write_latency)
+        write_latency->record(cost);
+
+    if (span) {
+        span->name = "write";
+        span->start = realtime_usec() - cost;
+        span->dur = cost;
+    }
+}
+
+coke::Task<coke::FileResult>
+PartitionIo::pwrite(int fd, void *buf, std::size_t size, off_t offset, TraceSpan *span) {
+    int64_t start = current_usec();
+    coke::FileResult res;
+
+    if (!policy.sync_engine)
+        res = co_await coke::pwrite(fd, buf, size, offset);
+    else {
+        co_await coke::switch_go_thread(queue);
+        res = to_result(::pwrite(fd, buf, size, offset));
+    }
+
+    record(span, start);
+    co_return res;
+}
+
+coke::Task<coke::FileResult>
+PartitionIo::pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                     TraceSpan *span) {
+    int64_t start = current_usec();
+    coke::FileResult res;
+
+    if (!policy.sync_engine)
+        res = co_await coke::pwritev(fd, iov, iovcnt, offset);
+    else {
+        co_await coke::switch_go_thread(queue);
+        res = to_result(::pwritev(fd, iov, iovcnt, offset));
+    }
+
+    record(span, start);
+    co_return res;
+}
+
+coke::FileResult
+PartitionIo::pwritev_sync(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    int64_t start = current_usec();
+    coke::FileResult res = to_result(::pwritev(fd, iov, iovcnt, offset));
+
+    record(nullptr, start);
+    return res;
+}
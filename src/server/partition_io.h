@@ -0,0 +1,70 @@
+#ifndef FCOPY_PARTITION_IO_H
+#define FCOPY_PARTITION_IO_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "coke/global.h"
+#include "coke/fileio.h"
+#include "coke/semaphore.h"
+#include "common/metrics.h"
+#include "common/structures.h"
+
+struct iovec;
+
+// PartitionIo runs the blocking operations of one partition on its own go
+// queue, and at most queue_depth of them at once, so that a slow or failing
+// disk only delays the files on it.
+class PartitionIo {
+public:
+    // writes are recorded in `write_latency` if not null
+    PartitionIo(const std::string &name, const PartitionPolicy &policy, bool directio,
+                Histogram *write_latency = nullptr);
+    PartitionIo(const PartitionIo &) = delete;
+
+    const std::string &get_name() const { return name; }
+    bool use_directio() const { return directio; }
+    int get_sync_mode() const { return policy.sync_mode; }
+
+    // files of a null sink are forwarded but never written or published
+    bool is_null_sink() const { return policy.null_sink; }
+
+    // whether acquire has anything to wait for
+    bool is_bounded() const { return sem || policy.rate_limit > 0; }
+
+    // wait until an operation of `size` bytes may run, and call release
+    // after the operation is done
+    coke::Task<> acquire(std::size_t size);
+    void release();
+
+    // continue on the go queue of this partition
+    coke::Task<> switch_thread();
+
+    // write with the engine of this partition, and fill `span` if not null
+    coke::Task<coke::FileResult> pwrite(int fd, void *buf, std::size_t size, off_t offset,
+                                        TraceSpan *span = nullptr);
+    coke::Task<coke::FileResult> pwritev(int fd, const struct iovec *iov, int iovcnt,
+                                         off_t offset, TraceSpan *span = nullptr);
+
+    // blocking pwritev, for callers already in the go queue of this partition
+    coke::FileResult pwritev_sync(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+private:
+    void record(TraceSpan *span, int64_t start);
+
+private:
+    std::string name;
+    std::string queue;
+    PartitionPolicy policy;
+    bool directio;
+
+    std::unique_ptr<coke::Semaphore> sem;
+    Histogram *write_latency;
+
+    std::mutex mtx;
+    int64_t next_usec{0};
+};
+
+#endif // FCOPY_PARTITION_IO_H
@@ -2,13 +2,16 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <type_traits>
+#include <algorithm>
 
 #include "coke/coke.h"
 #include "common/utils.h"
 #include "common/fcopy_log.h"
 
 static
-coke::Task<> write_file(int fd, std::string_view data, uint64_t offset, int &error) {
+coke::Task<> write_file(PartitionIo &part, TraceSpan *span, int fd,
+                        std::string_view data, uint64_t offset, int &error) {
     coke::FileResult res;
     void *pdata = (void *)data.data();
     std::size_t psize = data.size();
@@ -28,7 +31,8 @@ coke::Task<> write_file(int fd, std::string_view data, uint64_t offset, int &err
         memset((char *)pdata + data.size(), 0, psize - data.size());
     }
 
-    res = co_await coke::pwrite(fd, pdata, psize, offset);
+    res = co_await part.pwrite(fd, pdata, psize, offset, span);
+
     if (res.state != coke::STATE_SUCCESS)
         error = res.error;
     else
@@ -38,18 +42,77 @@ coke::Task<> write_file(int fd, std::string_view data, uint64_t offset, int &err
         std::free(pdata);
 }
 
+// run `task` after the scheduler grants it a slot
+template<typename T>
+static
+coke::Task<T> scheduled(IoScheduler *sched, int cls, std::size_t size, coke::Task<T> task) {
+    if (sched)
+        co_await sched->acquire(cls, size);
+
+    if constexpr (std::is_void_v<T>) {
+        co_await std::move(task);
+
+        if (sched)
+            sched->release();
+    }
+    else {
+        T ret = co_await std::move(task);
+
+        if (sched)
+            sched->release();
+        co_return ret;
+    }
+}
+
+// run `task` in a slot of the partition
+static
+coke::Task<> in_partition(PartitionIo *part, std::size_t size, coke::Task<> task) {
+    co_await part->acquire(size);
+    co_await std::move(task);
+    part->release();
+}
+
+static
+coke::Task<int> limited(LinkRateLimiter *limiter, const ChainTarget &to,
+                        std::size_t size, coke::Task<int> task) {
+    if (limiter)
+        co_await limiter->get(to.host, to.port, size);
+
+    co_return co_await std::move(task);
+}
+
 static
-coke::Task<int> send_one(FcopyClient &cli, RemoteTarget target, SendFileReq req) {
+coke::Task<int> send_one(FcopyClient &cli, ServerMetrics &metrics, TraceSpan *span,
+                         const RemoteTarget &target, SendFileReq req) {
     SendFileResp resp;
     std::string token;
+    std::size_t size;
+    unsigned stream_key;
+    int64_t start;
     int error;
 
+    // spread chunks of a file over streams by their index
+    stream_key = (unsigned)(req.offset / std::max<uint64_t>(req.origin_size, 1));
     token = req.file_token;
-    error = co_await cli.request(target, std::move(req), resp);
+    size = req.get_content_view().size();
+
+    if (span) {
+        span->name = "forward " + target.host + ":" + std::to_string(target.port);
+        span->start = realtime_usec();
+    }
+
+    start = current_usec();
+    error = co_await cli.request(target, std::move(req), resp, stream_key);
+    metrics.forward_latency.record(current_usec() - start);
+
+    if (span)
+        span->dur = current_usec() - start;
+
     if (error == 0)
         error = resp.get_error();
 
     if (error == 0) {
+        metrics.forwarded_bytes.add(size);
         FLOG_DEBUG("ChainSendSuccess host:%s port:%u token:%s",
             target.host.c_str(), (unsigned)target.port, token.c_str()
         );
@@ -64,9 +127,11 @@ coke::Task<int> send_one(FcopyClient &cli, RemoteTarget target, SendFileReq req)
 }
 
 static
-coke::Task<> send_chain(FcopyClient &cli, SendFileReq &origin,
-                        const std::vector<ChainTarget> &targets,
-                        std::vector<int> &errors) {
+coke::Task<> send_chain(FcopyClient &cli, ServerMetrics &metrics, LinkRateLimiter *limiter,
+                        IoScheduler *sched, int cls,
+                        SendFileReq &origin, const FileRef &ref,
+                        std::vector<TraceSpan> *spans, std::vector<int> &errors) {
+    const std::vector<ChainTarget> &targets = ref.targets;
     std::size_t size = targets.size();
     std::string_view data = origin.get_content_view();
     std::vector<coke::Task<int>> tasks;
@@ -75,7 +140,6 @@ coke::Task<> send_chain(FcopyClient &cli, SendFileReq &origin,
     for (std::size_t i = 0; i < size; i++) {
         const ChainTarget &to = targets[i];
         SendFileReq req;
-        RemoteTarget target;
 
         req.max_chain_len = origin.max_chain_len - 1;
         req.compress_type = origin.compress_type;
@@ -83,16 +147,25 @@ coke::Task<> send_chain(FcopyClient &cli, SendFileReq &origin,
         req.crc32 = origin.crc32;
         req.offset = origin.offset;
         req.file_token = to.file_token;
+        req.trace_id = origin.trace_id;
         req.set_content_view(data);
 
-        target.host = to.host;
-        target.port = to.port;
+        // each wrapper is one more coroutine frame per chunk, use them only
+        // when they have something to do
+        TraceSpan *span = spans ? &(*spans)[i] : nullptr;
+        coke::Task<int> task = send_one(cli, metrics, span, ref.remotes[i], std::move(req));
+        if (sched)
+            task = scheduled(sched, cls, data.size(), std::move(task));
+        if (limiter && limiter->is_limited())
+            task = limited(limiter, to, data.size(), std::move(task));
 
-        tasks.push_back(send_one(cli, target, std::move(req)));
+        tasks.push_back(std::move(task));
     }
 
-    errors = co_await coke::async_wait(std::move(tasks));
-    co_return;
+    if (size == 1)
+        errors.assign(1, co_await std::move(tasks[0]));
+    else
+        errors = co_await coke::async_wait(std::move(tasks));
 }
 
 int FcopyService::start() {
@@ -109,22 +182,90 @@ int FcopyService::start() {
         return -1;
     }
 
-    FcopyProcessor processor = [this](FcopyServerContext ctx) -> coke::Task<> {
-        co_await this->process(std::move(ctx));
-    };
+    fcopy_set_memory_budget(params.srv_params.memory_budget);
+    fcopy_set_chunk_pool_size(params.srv_params.chunk_pool_size);
 
-    servers.emplace_back(std::make_unique<FcopyServer>(srv_params, processor));
+    // sunk chunks are not written through the disk scheduler
+    bool receive_mmap = params.receive_mmap && !params.directio &&
+                        params.disk_sched_params.classes.empty();
 
-    ret = servers.back()->start(params.port);
-    if (ret != 0) {
-        FLOG_ERROR("ServerStartFailed error:%d", (int)errno);
-        return ret;
+    if (receive_mmap) {
+        FLOG_WARN("ReceiveMmap enabled, chunks are copied into files in network threads");
+        fcopy_set_data_sink([this](const std::string &token, uint64_t offset, std::size_t size) {
+            return mng ? mng->get_sink(token, offset, size) : nullptr;
+        });
     }
 
-    cli = std::make_unique<FcopyClient>(params.cli_params);
-    mng = std::make_unique<FileManager>();
+    default_part = std::make_shared<PartitionIo>("default", params.default_policy,
+                                                 params.directio, &metrics.write_latency);
+    for (const auto &it : params.partitions) {
+        const FsPartition &p = it.second;
+        parts.emplace(p.name, std::make_shared<PartitionIo>(p.name, p.policy,
+                                                            params.directio,
+                                                            &metrics.write_latency));
+    }
+
+    std::size_t listeners = (std::size_t)std::max(params.listeners, 1);
+    SocketParams sock_params = params.sock_params;
+    sock_params.reuse_port = (listeners > 1);
+
+    // files are sharded by token, a connection may carry chunks of any file
+    mng = std::make_unique<FileManager>(params.coalesce_params, receive_mmap,
+                                        listeners);
+
+    for (std::size_t i = 0; i < listeners; i++) {
+        FcopyClientParams cli_params = params.cli_params;
+
+        // forward through connections of this listener only
+        if (listeners > 1)
+            cli_params.lane += "listener-" + std::to_string(i) + "-";
+
+        clis.emplace_back(std::make_unique<FcopyClient>(cli_params));
+    }
+
+    fwd_limiter = std::make_unique<LinkRateLimiter>(params.fwd_rate_params);
+
+    if (!params.disk_sched_params.classes.empty())
+        disk_sched = std::make_unique<IoScheduler>(params.disk_sched_params);
+    if (!params.net_sched_params.classes.empty())
+        net_sched = std::make_unique<IoScheduler>(params.net_sched_params);
 
-    FLOG_INFO("ServerStart port:%d", params.port);
+    for (std::size_t i = 0; i < listeners; i++) {
+        FcopyProcessor processor = [this, i](FcopyServerContext ctx) -> coke::Task<> {
+            co_await this->process(std::move(ctx), i);
+        };
+
+        servers.emplace_back(std::make_unique<FcopyServer>(srv_params, processor,
+                                                           sock_params));
+
+        ret = servers.back()->start(params.port);
+        if (ret != 0) {
+            FLOG_ERROR("ServerStartFailed listener:%zu error:%d", i, (int)errno);
+            servers.pop_back();
+            stop();
+            servers.clear();
+            return ret;
+        }
+    }
+
+    if (params.metrics_port > 0) {
+        metrics_server = std::make_unique<WFHttpServer>([this](WFHttpTask *task) {
+            protocol::HttpResponse *resp = task->get_resp();
+
+            resp->set_http_version("HTTP/1.1");
+            resp->set_status_code("200");
+            resp->add_header_pair("Content-Type", "text/plain; version=0.0.4");
+            resp->append_output_body(get_stats());
+        });
+
+        // metrics are optional, serve files anyway
+        if (metrics_server->start(params.metrics_port) != 0) {
+            FLOG_ERROR("MetricsStartFailed port:%d error:%d", params.metrics_port, (int)errno);
+            metrics_server.reset();
+        }
+    }
+
+    FLOG_INFO("ServerStart port:%d listeners:%zu", params.port, listeners);
     running = true;
 
     return 0;
@@ -136,19 +277,49 @@ void FcopyService::wait() {
 }
 
 void FcopyService::notify() {
+    exiting = true;
+    running = false;
+    running.notify_all();
+}
+
+void FcopyService::notify_reload() {
+    reload = true;
     running = false;
     running.notify_all();
 }
 
+void FcopyService::resume() {
+    // notify sets its flag before clearing running, so a signal during reload
+    // is either seen here or clears running after this, and wait() returns
+    running = true;
+    if (exiting || reload)
+        running = false;
+}
+
+void FcopyService::set_forward_limit(const LinkRateParams &rate_params) {
+    fwd_limiter->set_params(rate_params);
+
+    FLOG_INFO("SetForwardLimit rate:%zu burst:%zu link_rate:%zu link_burst:%zu",
+        rate_params.rate, rate_params.burst,
+        rate_params.link_rate, rate_params.link_burst
+    );
+}
+
 void FcopyService::stop() {
+    if (metrics_server)
+        metrics_server->shutdown();
+
     for (auto &server : servers)
         server->shutdown();
 
     for (auto &server : servers)
         server->wait_finish();
+
+    if (metrics_server)
+        metrics_server->wait_finish();
 }
 
-coke::Task<> FcopyService::process(FcopyServerContext ctx) {
+coke::Task<> FcopyService::process(FcopyServerContext ctx, std::size_t listener) {
     Command cmd = ctx.get_req().get_command();
     ctx.get_resp().set_message(MessageBase(Command::UNKNOWN));
 
@@ -161,14 +332,30 @@ coke::Task<> FcopyService::process(FcopyServerContext ctx) {
         co_await handle_close_file(ctx);
         break;
 
+    case Command::DELETE_FILE_REQ:
+        co_await handle_delete_file(ctx);
+        break;
+
+    case Command::COMMIT_DIR_REQ:
+        co_await handle_commit_dir(ctx);
+        break;
+
     case Command::SEND_FILE_REQ:
-        co_await handle_send_file(ctx);
+        co_await handle_send_file(ctx, *clis[listener]);
         break;
 
     case Command::SET_CHAIN_REQ:
         co_await handle_set_chain(ctx);
         break;
 
+    case Command::STATS_REQ:
+        co_await handle_stats(ctx);
+        break;
+
+    case Command::GET_TRACE_REQ:
+        co_await handle_get_trace(ctx);
+        break;
+
     default:
         co_await ctx.reply();
         break;
@@ -181,29 +368,63 @@ coke::Task<> FcopyService::handle_create_file(FcopyServerContext &ctx) {
     std::string file_token;
     std::string partition_dir;
     std::string abs_path;
+    std::string commit_path;
+    std::string old_stage;
+    std::shared_ptr<PartitionIo> part;
+    bool atomic;
+    int sched_class;
     int error;
 
     if (!ctx.get_req().move_message(req))
         co_return;
 
+    // staged files are published by commit dir
+    atomic = req.atomic && req.commit_dir.empty();
+
+    // both schedulers are built from the same classes
+    sched_class = disk_sched ? disk_sched->get_class(req.sched_class) : 0;
+
     partition_dir = get_partition_dir(req.partition);
-    if (partition_dir.empty())
+    part = get_partition_io(req.partition);
+    if (partition_dir.empty() || !part)
         error = ERR_NO_PARTITION;
     else
         error = get_abs_path(partition_dir, req.relative_path, req.file_name, abs_path);
 
+    // nothing is staged in a null sink
+    if (error == 0 && !req.commit_dir.empty() && !part->is_null_sink()) {
+        error = get_abs_path(partition_dir, req.commit_dir, commit_path);
+        if (error == 0)
+            error = mng->get_stage_path(commit_path, abs_path, abs_path, old_stage);
+    }
+
     if (error == 0)
-        error = mng->create_file(abs_path, req.file_size, req.chunk_size, params.directio, file_token);
+        error = mng->create_file(abs_path, req.file_size, req.chunk_size,
+                                 part, atomic, sched_class, file_token);
+
+    if (error == 0)
+        metrics.open_files.fetch_add(1, std::memory_order_relaxed);
+    else
+        metrics.add_error(error);
 
     FLOG_INFO("CreateFile file:%s size:%zu error:%d token:%s",
         abs_path.c_str(), (std::size_t)req.file_size, error, file_token.c_str()
     );
 
     resp.set_error(error);
+    resp.max_chunk_size = max_chunk_size();
     resp.file_token = file_token;
     ctx.get_resp().set_message(std::move(resp));
 
     co_await ctx.reply();
+
+    // what a failed job left in the stage, removed after the reply
+    if (!old_stage.empty()) {
+        co_await part->acquire(0);
+        co_await part->switch_thread();
+        FileManager::remove_stage(old_stage);
+        part->release();
+    }
 }
 
 coke::Task<> FcopyService::handle_close_file(FcopyServerContext &ctx) {
@@ -218,9 +439,14 @@ coke::Task<> FcopyService::handle_close_file(FcopyServerContext &ctx) {
     wait = req.wait_close;
 
     if (wait) {
-        // close file may block, switch to go thread
-        co_await coke::switch_go_thread("close_file");
-        error = mng->close_file(req.file_token);
+        // the client is waiting, flush the file ahead of queued chunks
+        if (disk_sched)
+            co_await disk_sched->acquire_urgent();
+
+        error = co_await finish_file(req.file_token, false);
+
+        if (disk_sched)
+            disk_sched->release();
     }
     else {
         if (mng->has_file(req.file_token))
@@ -233,18 +459,79 @@ coke::Task<> FcopyService::handle_close_file(FcopyServerContext &ctx) {
     ctx.get_resp().set_message(std::move(resp));
     co_await ctx.reply();
 
-    if (!wait) {
-        co_await coke::switch_go_thread("close_file");
-        error = mng->close_file(req.file_token);
-    }
+    if (!wait)
+        error = co_await finish_file(req.file_token, false);
+
+    if (error)
+        metrics.add_error(error);
 
     FLOG_INFO("CloseFile error:%d token:%s",
         error, req.file_token.c_str()
     );
 }
 
-coke::Task<> FcopyService::handle_send_file(FcopyServerContext &ctx) {
-    std::vector<ChainTarget> targets;
+coke::Task<> FcopyService::handle_delete_file(FcopyServerContext &ctx) {
+    DeleteFileReq req;
+    DeleteFileResp resp;
+    int error;
+
+    if (!ctx.get_req().move_message(req))
+        co_return;
+
+    error = co_await finish_file(req.file_token, true);
+
+    if (error)
+        metrics.add_error(error);
+
+    FLOG_INFO("DeleteFile error:%d token:%s",
+        error, req.file_token.c_str()
+    );
+
+    resp.set_error(error);
+    ctx.get_resp().set_message(std::move(resp));
+    co_await ctx.reply();
+}
+
+coke::Task<> FcopyService::handle_commit_dir(FcopyServerContext &ctx) {
+    CommitDirReq req;
+    CommitDirResp resp;
+    std::string partition_dir;
+    std::string commit_path;
+    std::shared_ptr<PartitionIo> part;
+    int error;
+
+    if (!ctx.get_req().move_message(req))
+        co_return;
+
+    partition_dir = get_partition_dir(req.partition);
+    part = get_partition_io(req.partition);
+    if (partition_dir.empty() || !part)
+        error = ERR_NO_PARTITION;
+    else
+        error = get_abs_path(partition_dir, req.commit_dir, commit_path);
+
+    if (error == 0 && !part->is_null_sink()) {
+        // rename and remove dirs may block, switch to go thread
+        co_await part->acquire(0);
+        co_await part->switch_thread();
+        error = mng->commit_dir(commit_path, req.discard);
+        part->release();
+    }
+
+    if (error)
+        metrics.add_error(error);
+
+    FLOG_INFO("CommitDir dir:%s discard:%d error:%d",
+        commit_path.c_str(), (int)req.discard, error
+    );
+
+    resp.set_error(error);
+    ctx.get_resp().set_message(std::move(resp));
+    co_await ctx.reply();
+}
+
+coke::Task<> FcopyService::handle_send_file(FcopyServerContext &ctx, FcopyClient &cli) {
+    FileRef ref;
     SendFileReq req;
     SendFileResp resp;
     int fd;
@@ -252,20 +539,88 @@ coke::Task<> FcopyService::handle_send_file(FcopyServerContext &ctx) {
     if (!ctx.get_req().move_message(req))
         co_return;
 
-    fd = mng->get_fd(req.file_token, targets);
+    metrics.chunks.add(1);
+    if (req.get_recv_start() != 0)
+        metrics.receive_latency.record(current_usec() - req.get_recv_start());
+
+    if (req.is_rejected()) {
+        metrics.add_error(ERR_SERVER_BUSY);
+        FLOG_EVERY_MS(DEBUG, 1000, "SendFileRejected token:%s offset:%zu budget_used:%zu",
+            req.file_token.c_str(), (std::size_t)req.offset, fcopy_get_memory_used()
+        );
+
+        resp.set_error(ERR_SERVER_BUSY);
+        ctx.get_resp().set_message(std::move(resp));
+        co_return;
+    }
+
+    fd = mng->get_fd(req.file_token, ref);
     if (fd < 0)
         resp.set_error(-ENOENT);
-    else if (req.max_chain_len <= 1 && !targets.empty())
+    else if (req.max_chain_len <= 1 && !ref.targets.empty())
         resp.set_error(-ECANCELED);
     else {
         std::string_view data = req.get_content_view();
         std::vector<int> chain_errors;
         int write_error;
+        int cls = ref.sched_class;
+
+        // forward spans of each target, then write, receive and handle
+        std::size_t ntargets = ref.targets.size();
+        std::vector<TraceSpan> spans;
+        std::vector<TraceSpan> *pspans = nullptr;
+        TraceSpan *write_span = nullptr;
+        int64_t start = current_usec();
+
+        if (req.trace_id != 0) {
+            spans.resize(ntargets + 3);
+            pspans = &spans;
+            write_span = &spans[ntargets];
+        }
 
-        co_await coke::async_wait(
-            send_chain(*cli, req, targets, chain_errors),
-            write_file(fd, data, req.offset, write_error)
-        );
+        metrics.received_bytes.add(data.size());
+        metrics.inflight_chunks.fetch_add(1, std::memory_order_relaxed);
+
+        if (req.is_sunk() || ref.part->is_null_sink()) {
+            // the data is received into the mapped file already, or discarded
+            write_error = 0;
+
+            if (!ref.targets.empty()) {
+                co_await send_chain(cli, metrics, fwd_limiter.get(), net_sched.get(), cls,
+                                    req, ref, pspans, chain_errors);
+            }
+        }
+        else {
+            // the coalescer may hold the data after this request is replied
+            std::shared_ptr<char> owner;
+            if (ref.coalescer)
+                owner = req.release_data();
+
+            // the coalescer takes the partition and disk slots for each run
+            // it writes, a chunk waiting for the gap below it must not hold one
+            CoalesceSlots slots{disk_sched.get(), cls,
+                                ref.part->is_bounded() ? ref.part.get() : nullptr};
+            coke::Task<> write = ref.coalescer
+                ? ref.coalescer->write(owner, data, req.offset, slots, write_span, write_error)
+                : write_file(*ref.part, write_span, fd, data, req.offset, write_error);
+
+            if (!ref.coalescer && ref.part->is_bounded())
+                write = in_partition(ref.part.get(), data.size(), std::move(write));
+            if (!ref.coalescer && disk_sched)
+                write = scheduled(disk_sched.get(), cls, data.size(), std::move(write));
+
+            // leaf servers have nothing to forward, skip the chain frames
+            if (ref.targets.empty()) {
+                co_await std::move(write);
+            }
+            else {
+                co_await coke::async_wait(
+                    send_chain(cli, metrics, fwd_limiter.get(), net_sched.get(), cls,
+                               req, ref, pspans, chain_errors),
+                    std::move(write)
+                );
+            }
+        }
 
         // get first error
         int error = 0;
@@ -280,9 +635,21 @@ coke::Task<> FcopyService::handle_send_file(FcopyServerContext &ctx) {
         if (error == 0)
             error = write_error;
 
+        if (ref.part->is_null_sink())
+            metrics.discarded_bytes.add(data.size());
+        else if (write_error == 0)
+            metrics.written_bytes.add(data.size());
+
+        metrics.inflight_chunks.fetch_add(-1, std::memory_order_relaxed);
         resp.set_error(error);
+
+        if (pspans)
+            record_spans(req, start, spans);
     }
 
+    if (resp.get_error() != 0)
+        metrics.add_error(resp.get_error());
+
     ctx.get_resp().set_message(std::move(resp));
     co_return;
 }
@@ -295,13 +662,146 @@ coke::Task<> FcopyService::handle_set_chain(FcopyServerContext &ctx) {
     if (!ctx.get_req().move_message(req))
         co_return;
 
-    error = mng->set_chain_targets(req.file_token, req.targets);
+    // resolve once here, chunks of the file are forwarded without parsing
+    // urls, getaddrinfo may block so it is not done in the handler thread
+    co_await coke::switch_go_thread("resolve");
+
+    std::vector<RemoteTarget> remotes;
+    remotes.reserve(req.targets.size());
+    for (const ChainTarget &to : req.targets) {
+        RemoteTarget &target = remotes.emplace_back(to.host, to.port);
+        resolve_target(target);
+    }
+
+    error = mng->set_chain_targets(req.file_token, req.targets, remotes);
     resp.set_error(error);
 
     ctx.get_resp().set_message(std::move(resp));
     co_return;
 }
 
+void FcopyService::record_spans(const SendFileReq &req, int64_t start,
+                                std::vector<TraceSpan> &spans) {
+    int64_t now = current_usec();
+    int64_t real_now = realtime_usec();
+    std::size_t n = spans.size();
+
+    // steady clock to wall clock
+    auto real = [now, real_now](int64_t t) { return real_now - (now - t); };
+
+    if (req.get_recv_start() != 0) {
+        spans[n-2].name = "receive";
+        spans[n-2].start = real(req.get_recv_start());
+        spans[n-2].dur = start - req.get_recv_start();
+    }
+
+    spans[n-1].name = "handle";
+    spans[n-1].start = real(start);
+    spans[n-1].dur = now - start;
+
+    // drop the phases that did not happen, e.g. write of coalesced chunks
+    std::erase_if(spans, [](const TraceSpan &s) { return s.name.empty(); });
+
+    for (TraceSpan &s : spans) {
+        s.trace_id = req.trace_id;
+        s.offset = req.offset;
+    }
+
+    mng->add_spans(req.file_token, spans);
+}
+
+coke::Task<> FcopyService::handle_get_trace(FcopyServerContext &ctx) {
+    GetTraceReq req;
+    GetTraceResp resp;
+    int error;
+
+    if (!ctx.get_req().move_message(req))
+        co_return;
+
+    error = mng->take_spans(req.file_token, resp.spans);
+    resp.set_error(error);
+
+    ctx.get_resp().set_message(std::move(resp));
+    co_return;
+}
+
+coke::Task<> FcopyService::handle_stats(FcopyServerContext &ctx) {
+    StatsReq req;
+    StatsResp resp;
+
+    if (!ctx.get_req().move_message(req))
+        co_return;
+
+    resp.text = get_stats();
+    ctx.get_resp().set_message(std::move(resp));
+    co_return;
+}
+
+std::string FcopyService::get_stats() {
+    std::map<std::string, int64_t> gauges;
+
+    gauges["fcopy_memory_used_bytes"] = (int64_t)fcopy_get_memory_used();
+    gauges["fcopy_chunk_pool_idle_bytes"] = (int64_t)fcopy_get_chunk_pool_idle();
+
+    if (disk_sched)
+        gauges["fcopy_disk_queue_waiting"] = (int64_t)disk_sched->get_waiting();
+    if (net_sched)
+        gauges["fcopy_net_queue_waiting"] = (int64_t)net_sched->get_waiting();
+
+    return metrics.to_prometheus(gauges);
+}
+
+uint32_t FcopyService::max_chunk_size() const {
+    // leave room for message header and body
+    constexpr std::size_t reserved = 64 * 1024;
+    std::size_t limit = params.srv_params.request_size_limit;
+    std::size_t size;
+
+    if (limit <= reserved)
+        return 0;
+
+    size = std::min<std::size_t>(limit - reserved, UINT32_MAX);
+    return size / FCOPY_CHUNK_BASE * FCOPY_CHUNK_BASE;
+}
+
+std::shared_ptr<PartitionIo> FcopyService::get_partition_io(const std::string &partition) {
+    if (partition.empty())
+        return default_part;
+
+    auto it = parts.find(partition);
+    if (it == parts.end())
+        return nullptr;
+
+    return it->second;
+}
+
+coke::Task<int> FcopyService::finish_file(const std::string &file_token, bool remove) {
+    std::shared_ptr<PartitionIo> part;
+    FileRef ref;
+    int error;
+
+    if (mng->get_fd(file_token, ref) < 0)
+        co_return -ENOENT;
+
+    part = ref.part;
+
+    // close and remove file may block, switch to go thread of the partition
+    co_await part->acquire(0);
+    co_await part->switch_thread();
+
+    if (remove)
+        error = mng->delete_file(file_token);
+    else
+        error = mng->close_file(file_token);
+
+    // the file is removed from manager even if closing failed
+    if (error != -ENOENT)
+        metrics.open_files.fetch_add(-1, std::memory_order_relaxed);
+
+    part->release();
+    co_return error;
+}
+
 std::string FcopyService::get_partition_dir(const std::string &partition) {
     if (partition.empty())
         return params.default_partition;
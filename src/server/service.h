@@ -10,7 +10,11 @@
 
 #include "common/co_fcopy.h"
 #include "common/error_code.h"
+#include "common/rate_limiter.h"
 #include "server/file_manager.h"
+#include "server/io_scheduler.h"
+#include "server/metrics.h"
+#include "workflow/WFHttpServer.h"
 
 struct FcopyServerParams {
     size_t max_connections      = 4096;
@@ -18,17 +22,45 @@ struct FcopyServerParams {
     int receive_timeout         = -1;
     int keep_alive_timeout      = 300 * 1000;
     size_t request_size_limit   = 128ULL * 1024 * 1024;
+
+    // bytes of all in-flight chunk buffers, 0 means no limit
+    size_t memory_budget        = 0;
+
+    // bytes of freed chunk buffers kept for reuse
+    size_t chunk_pool_size      = 0;
 };
 
 struct FcopyServiceParams {
     bool directio;
 
     int port;
+    // port of the prometheus metrics listener, 0 means disabled
+    int metrics_port = 0;
+
+    // listening sockets on the port, each with its own forward client
+    int listeners = 1;
+
     std::string default_partition;
     std::map<std::string, FsPartition> partitions;
+    PartitionPolicy default_policy;
+
+    WriteCoalesceParams coalesce_params;
+
+    // receive chunks of leaf files into mapped files in buffered mode
+    bool receive_mmap = false;
+
+    // scheduling is enabled if classes are configured
+    IoSchedulerParams disk_sched_params;
+    IoSchedulerParams net_sched_params;
+
+    // limit of bytes forwarded to the next servers in chain
+    LinkRateParams fwd_rate_params;
 
     FcopyServerParams srv_params;
     FcopyClientParams cli_params;
+
+    // options of the listening socket, inherited by accepted connections
+    SocketParams sock_params;
 };
 
 class FcopyService {
@@ -41,23 +73,56 @@ public:
     void notify();
     void stop();
 
+    // wake up wait() for reloading config, and continue serving by resume()
+    void notify_reload();
+    // consume a pending reload, one notified while reloading stays pending
+    bool take_reload() { return !exiting && reload.exchange(false); }
+    void resume();
+
+    void set_forward_limit(const LinkRateParams &rate_params);
+
 private:
-    coke::Task<> process(FcopyServerContext ctx);
+    coke::Task<> process(FcopyServerContext ctx, std::size_t listener);
 
     coke::Task<> handle_create_file(FcopyServerContext &ctx);
     coke::Task<> handle_close_file(FcopyServerContext &ctx);
-    coke::Task<> handle_send_file(FcopyServerContext &ctx);
+    coke::Task<> handle_delete_file(FcopyServerContext &ctx);
+    coke::Task<> handle_commit_dir(FcopyServerContext &ctx);
+    coke::Task<> handle_send_file(FcopyServerContext &ctx, FcopyClient &cli);
     coke::Task<> handle_set_chain(FcopyServerContext &ctx);
+    coke::Task<> handle_stats(FcopyServerContext &ctx);
+    coke::Task<> handle_get_trace(FcopyServerContext &ctx);
+
+    // keep the spans of a sampled chunk handled since `start`
+    void record_spans(const SendFileReq &req, int64_t start, std::vector<TraceSpan> &spans);
+
+    std::string get_stats();
 
     std::string get_partition_dir(const std::string &partition);
+    std::shared_ptr<PartitionIo> get_partition_io(const std::string &partition);
+
+    // close or delete the file on the go queue of its partition
+    coke::Task<int> finish_file(const std::string &file_token, bool remove);
+    uint32_t max_chunk_size() const;
 
 private:
     std::atomic<bool> running{false};
+    std::atomic<bool> reload{false};
+    std::atomic<bool> exiting{false};
     FcopyServiceParams params;
 
     std::vector<std::unique_ptr<FcopyServer>> servers;
-    std::unique_ptr<FcopyClient> cli;
+    std::vector<std::unique_ptr<FcopyClient>> clis;
     std::unique_ptr<FileManager> mng;
+    std::unique_ptr<IoScheduler> disk_sched;
+    std::unique_ptr<IoScheduler> net_sched;
+    std::unique_ptr<LinkRateLimiter> fwd_limiter;
+
+    std::shared_ptr<PartitionIo> default_part;
+    std::map<std::string, std::shared_ptr<PartitionIo>> parts;
+
+    ServerMetrics metrics;
+    std::unique_ptr<WFHttpServer> metrics_server;
 };
 
 #endif // FCOPY_SERVICE_H
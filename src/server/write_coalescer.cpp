@@ -0,0 +1,249 @@
+#include "server/write_coalescer.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+
+#include "common/message.h"
+#include "server/io_scheduler.h"
+#include "server/partition_io.h"
+
+// copy data into an aligned buffer owned by `owner`, pad it to FCOPY_CHUNK_BASE
+static bool copy_chunk(std::shared_ptr<char> &owner, std::string_view &data) {
+    std::size_t psize = data.size();
+    char *p;
+
+    if (psize % FCOPY_CHUNK_BASE != 0)
+        psize = (psize / FCOPY_CHUNK_BASE + 1) * FCOPY_CHUNK_BASE;
+
+    p = static_cast<char *>(std::aligned_alloc(FCOPY_CHUNK_BASE, psize));
+    if (p == nullptr)
+        return false;
+
+    memcpy(p, data.data(), data.size());
+    memset(p + data.size(), 0, psize - data.size());
+
+    owner.reset(p, std::free);
+    data = std::string_view(p, psize);
+    return true;
+}
+
+coke::Task<> WriteCoalescer::write(std::shared_ptr<char> owner, std::string_view data,
+                                   uint64_t offset, const CoalesceSlots &slots,
+                                   TraceSpan *span, int &error) {
+    std::vector<Run> runs;
+    coke::Latch latch(1);
+    int chunk_error = 0;
+    bool durable = !params.buffered_ack;
+
+    if (!owner || data.size() % FCOPY_CHUNK_BASE != 0) {
+        // not owned or the last unaligned chunk
+        if (!copy_chunk(owner, data)) {
+            error = errno;
+            co_return;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+
+        if (first_error != 0) {
+            error = first_error;
+            co_return;
+        }
+
+        Chunk chunk {
+            .offset = offset,
+            .owner = std::move(owner),
+            .data = data,
+            .latch = durable ? &latch : nullptr,
+            .error = &chunk_error,
+            .span = durable ? span : nullptr
+        };
+
+        if (offset < next_offset || pending.contains(offset)) {
+            // retried chunk, write it directly
+            runs.emplace_back();
+            runs.back().push_back(std::move(chunk));
+        }
+        else {
+            pending_bytes += data.size();
+            pending.emplace(offset, std::move(chunk));
+            take_runs(runs);
+        }
+    }
+
+    int run_error = 0;
+    for (Run &run : runs) {
+        int ret = co_await write_run(run, slots);
+        if (run_error == 0)
+            run_error = ret;
+    }
+
+    if (durable) {
+        co_await latch.wait();
+        error = chunk_error;
+    }
+    else
+        error = run_error;
+}
+
+int WriteCoalescer::flush_all() {
+    std::vector<Run> runs;
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        take_all(runs);
+    }
+
+    for (Run &run : runs)
+        write_run_sync(run);
+
+    std::lock_guard<std::mutex> lg(mtx);
+    return first_error;
+}
+
+void WriteCoalescer::take_runs(std::vector<Run> &runs) {
+    while (true) {
+        auto wit = written.begin();
+        if (wit != written.end() && wit->first == next_offset) {
+            next_offset = wit->second;
+            written.erase(wit);
+            continue;
+        }
+
+        auto it = pending.begin();
+        if (it == pending.end() || it->first != next_offset)
+            break;
+
+        next_offset = take_run(it, runs);
+    }
+
+    // the window is full, write the lowest chunks out of order
+    while (pending_bytes > params.window_size) {
+        auto it = pending.begin();
+        uint64_t offset = it->first;
+        uint64_t end = take_run(it, runs);
+
+        written.emplace(offset, end);
+    }
+}
+
+void WriteCoalescer::take_all(std::vector<Run> &runs) {
+    while (!pending.empty())
+        take_run(pending.begin(), runs);
+}
+
+uint64_t WriteCoalescer::take_run(std::map<uint64_t, Chunk>::iterator it,
+                                  std::vector<Run> &runs) {
+    Run run;
+    std::size_t bytes = 0;
+    uint64_t end = it->first;
+
+    while (it != pending.end() && it->first == end && run.size() < IOV_MAX) {
+        std::size_t size = it->second.data.size();
+        if (!run.empty() && bytes + size > params.flush_size)
+            break;
+
+        bytes += size;
+        end += size;
+        run.push_back(std::move(it->second));
+        it = pending.erase(it);
+    }
+
+    pending_bytes -= bytes;
+    runs.push_back(std::move(run));
+    return end;
+}
+
+coke::Task<int> WriteCoalescer::write_run(Run &run, const CoalesceSlots &slots) {
+    std::vector<struct iovec> iov(run.size());
+    std::size_t total = 0;
+    coke::FileResult res;
+    TraceSpan span;
+    bool sampled = false;
+    int error;
+
+    for (std::size_t i = 0; i < run.size(); i++) {
+        iov[i].iov_base = const_cast<char *>(run[i].data.data());
+        iov[i].iov_len = run[i].data.size();
+        total += iov[i].iov_len;
+        sampled = sampled || run[i].span;
+    }
+
+    // the same order as other writes and closes, scheduler then partition
+    if (slots.sched)
+        co_await slots.sched->acquire(slots.cls, total);
+    if (slots.part)
+        co_await slots.part->acquire(total);
+
+    res = co_await part->pwritev(fd, iov.data(), (int)iov.size(), run[0].offset,
+                                 sampled ? &span : nullptr);
+
+    if (slots.part)
+        slots.part->release();
+    if (slots.sched)
+        slots.sched->release();
+
+    if (res.state != coke::STATE_SUCCESS)
+        error = res.error;
+    else if ((std::size_t)res.nbytes != total)
+        error = EIO;
+    else
+        error = 0;
+
+    // every sampled chunk of the run waited for the same write
+    for (Chunk &chunk : run) {
+        if (chunk.span) {
+            chunk.span->name = span.name;
+            chunk.span->start = span.start;
+            chunk.span->dur = span.dur;
+        }
+    }
+
+    finish_run(run, error);
+    co_return error;
+}
+
+int WriteCoalescer::write_run_sync(Run &run) {
+    std::vector<struct iovec> iov(run.size());
+    std::size_t total = 0;
+    coke::FileResult res;
+    int error;
+
+    for (std::size_t i = 0; i < run.size(); i++) {
+        iov[i].iov_base = const_cast<char *>(run[i].data.data());
+        iov[i].iov_len = run[i].data.size();
+        total += iov[i].iov_len;
+    }
+
+    // called by close in the go queue of the partition
+    res = part->pwritev_sync(fd, iov.data(), (int)iov.size(), run[0].offset);
+    if (res.state != coke::STATE_SUCCESS)
+        error = res.error;
+    else if ((std::size_t)res.nbytes != total)
+        error = EIO;
+    else
+        error = 0;
+
+    finish_run(run, error);
+    return error;
+}
+
+void WriteCoalescer::finish_run(Run &run, int error) {
+    if (error != 0) {
+        std::lock_guard<std::mutex> lg(mtx);
+        if (first_error == 0)
+            first_error = error;
+    }
+
+    for (Chunk &chunk : run) {
+        // the waiter may be destroyed after count down
+        if (chunk.latch) {
+            *chunk.error = error;
+            chunk.latch->count_down();
+        }
+    }
+}
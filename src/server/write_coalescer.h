@@ -0,0 +1,100 @@
+#ifndef FCOPY_WRITE_COALESCER_H
+#define FCOPY_WRITE_COALESCER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "coke/global.h"
+#include "coke/latch.h"
+#include "common/structures.h"
+
+class IoScheduler;
+class PartitionIo;
+
+// slots a run takes while it is written, chunks waiting for the chunks below
+// them must not hold any, or the missing chunks could never get one
+struct CoalesceSlots {
+    IoScheduler *sched  = nullptr;
+    int cls             = 0;
+    PartitionIo *part   = nullptr;
+};
+
+struct WriteCoalesceParams {
+    bool enable             = false;
+
+    // ack a chunk once it is buffered, instead of once it is written to disk
+    bool buffered_ack       = false;
+
+    // max bytes held in the reorder window of one file
+    std::size_t window_size = 64ULL << 20;
+
+    // max bytes written by one pwritev
+    std::size_t flush_size  = 16ULL << 20;
+};
+
+// WriteCoalescer holds chunks of one file that arrive out of order, and writes
+// them as sequential pwritev once the chunk at the write cursor arrives. If the
+// window exceeds `window_size`, the lowest buffered chunks are written anyway.
+class WriteCoalescer {
+    struct Chunk {
+        uint64_t offset;
+        std::shared_ptr<char> owner;
+        std::string_view data;
+
+        // set for durable ack, the waiter is notified after the chunk is written
+        coke::Latch *latch;
+        int *error;
+
+        // write span of a sampled chunk, only set for durable ack
+        TraceSpan *span;
+    };
+
+    using Run = std::vector<Chunk>;
+
+public:
+    // runs are written through `part`, with its engine and metrics
+    WriteCoalescer(int fd, std::shared_ptr<PartitionIo> part,
+                   const WriteCoalesceParams &params)
+        : fd(fd), part(std::move(part)), params(params)
+    { }
+
+    WriteCoalescer(const WriteCoalescer &) = delete;
+
+    // write `data` at `offset`, `owner` keeps data alive until it is written
+    coke::Task<> write(std::shared_ptr<char> owner, std::string_view data,
+                       uint64_t offset, const CoalesceSlots &slots, TraceSpan *span,
+                       int &error);
+
+    // write out all buffered chunks synchronously and return the first error
+    // of this file, called before the file is closed
+    int flush_all();
+
+private:
+    void take_runs(std::vector<Run> &runs);
+    void take_all(std::vector<Run> &runs);
+    uint64_t take_run(std::map<uint64_t, Chunk>::iterator it, std::vector<Run> &runs);
+
+    coke::Task<int> write_run(Run &run, const CoalesceSlots &slots);
+    int write_run_sync(Run &run);
+    void finish_run(Run &run, int error);
+
+private:
+    int fd;
+    std::shared_ptr<PartitionIo> part;
+    WriteCoalesceParams params;
+
+    std::mutex mtx;
+    int first_error{0};
+    uint64_t next_offset{0};
+    std::size_t pending_bytes{0};
+    std::map<uint64_t, Chunk> pending;
+
+    // ranges after next_offset written before the cursor reached them
+    std::map<uint64_t, uint64_t> written;
+};
+
+#endif // FCOPY_WRITE_COALESCER_H
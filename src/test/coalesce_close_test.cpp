@@ -0,0 +1,91 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "coke/coke.h"
+#include "common/message.h"
+#include "server/io_scheduler.h"
+#include "server/partition_io.h"
+#include "server/write_coalescer.h"
+
+/**
+ * A waited close holds the disk scheduler while it waits for the partition,
+ * see FcopyService::handle_close_file. With one slot in each, a coalesced run
+ * taking them in the other order waits for the close forever, and this test
+ * hangs until the ctest timeout.
+ */
+
+coke::Task<> waited_close(IoScheduler &sched, PartitionIo &part, coke::Latch &closing) {
+    co_await sched.acquire_urgent();
+    closing.count_down();
+
+    // let the run start waiting for its slots
+    co_await coke::sleep(std::chrono::milliseconds(50));
+
+    co_await part.acquire(0);
+    part.release();
+    sched.release();
+}
+
+coke::Task<> coalesced_run(WriteCoalescer &wc, IoScheduler &sched, PartitionIo &part,
+                           coke::Latch &closing, int &error) {
+    std::string data(FCOPY_CHUNK_BASE, 'x');
+    CoalesceSlots slots{&sched, 0, &part};
+
+    co_await closing.wait();
+    co_await wc.write(nullptr, data, 0, slots, nullptr, error);
+}
+
+coke::Task<> run_both(IoScheduler &sched, PartitionIo &part, WriteCoalescer &wc,
+                      int &error) {
+    coke::Latch closing(1);
+    std::vector<coke::Task<>> tasks;
+
+    tasks.push_back(waited_close(sched, part, closing));
+    tasks.push_back(coalesced_run(wc, sched, part, closing, error));
+    co_await coke::async_wait(std::move(tasks));
+}
+
+int main() {
+    char path[] = "/tmp/fcopy-coalesce-close-XXXXXX";
+    int fd = mkstemp(path);
+    int error = -1;
+    struct stat st;
+
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    unlink(path);
+
+    IoSchedulerParams sched_params;
+    sched_params.concurrency = 1;
+    sched_params.classes.push_back(SchedClass{"default", 1, 0});
+
+    PartitionPolicy policy;
+    policy.queue_depth = 1;
+
+    WriteCoalesceParams coalesce_params;
+    coalesce_params.enable = true;
+
+    IoScheduler sched(sched_params);
+    auto part = std::make_shared<PartitionIo>("test", policy, false);
+    WriteCoalescer wc(fd, part, coalesce_params);
+
+    coke::sync_wait(run_both(sched, *part, wc, error));
+
+    if (error != 0 || fstat(fd, &st) != 0 || st.st_size != (off_t)FCOPY_CHUNK_BASE) {
+        fprintf(stderr, "coalesced run failed, error:%d\n", error);
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
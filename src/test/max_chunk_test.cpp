@@ -0,0 +1,41 @@
+#include <cstdio>
+
+#include "client/adaptive_controller.h"
+
+/**
+ * Each target of a chain advertises its own max chunk size in CreateFileResp,
+ * chunks must fit the smallest of them and the local max_chunk, whatever the
+ * order the responses arrive in.
+ */
+
+constexpr std::size_t MB = 1024 * 1024;
+
+static bool check(const char *name, std::size_t local_max,
+                  std::size_t first, std::size_t second, std::size_t expect) {
+    AdaptiveParams params;
+    params.max_chunk = local_max;
+    params.init_chunk = local_max;
+
+    AdaptiveController ctl(params);
+    ctl.set_max_chunk_size(first);
+    ctl.set_max_chunk_size(second);
+
+    // the chunk size grows up to the max later
+    std::size_t size = ctl.get_max_chunk_size();
+    if (size != expect || ctl.get_chunk_size() > expect) {
+        fprintf(stderr, "%s: max chunk %zu, expect %zu\n", name, size, expect);
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    bool ok = true;
+
+    ok &= check("smaller first", 64 * MB, 8 * MB, 32 * MB, 8 * MB);
+    ok &= check("smaller last", 64 * MB, 32 * MB, 8 * MB, 8 * MB);
+    ok &= check("local smallest", 4 * MB, 32 * MB, 16 * MB, 4 * MB);
+
+    return ok ? 0 : 1;
+}